@@ -0,0 +1,377 @@
+
+#include "subprocess.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace splib;
+
+using clock_type = std::chrono::steady_clock;
+
+// every result is printed as one json object per line on stdout so runs can be compared between releases
+class record
+{
+public:
+	record(const char* bench, const std::string& variant)
+	{
+		m_line.precision(15); // byte counts stay exact
+		m_line << "{\"bench\":\"" << bench << "\",\"variant\":\"" << variant << "\"";
+	}
+	~record()
+	{
+		m_line << "}";
+		std::cout << m_line.str() << std::endl;
+	}
+
+	record& value(const char* name, const double v)
+	{
+		m_line << ",\"" << name << "\":" << v;
+		return *this;
+	}
+
+protected:
+	std::ostringstream m_line;
+};
+
+struct options
+{
+	bool		quick = false;
+	std::string filter;
+	//^ only benchmarks whose name contains this run
+
+	std::size_t scale(const std::size_t n) const
+	{
+		return quick ? std::max<std::size_t>(n / 20, 10) : n;
+	}
+	bool selected(const char* bench) const
+	{
+		return filter.empty() || std::string(bench).find(filter) != std::string::npos;
+	}
+};
+
+subprocess::CreateData true_command()
+{
+	subprocess::CreateData cd;
+	cd.exe = "/bin/true";
+	cd.argv = { "true" };
+	return cd;
+}
+
+void percentiles(record& r, std::vector<double>& samples)
+{
+	std::sort(samples.begin(), samples.end());
+	r.value("samples", double(samples.size()));
+	r.value("p50_us", samples[samples.size() / 2]);
+	r.value("p99_us", samples[samples.size() * 99 / 100]);
+	r.value("max_us", samples.back());
+}
+
+double throughput(const subprocess::CreateData& cd, const std::size_t total_bytes)
+{
+	std::size_t received = 0;
+
+	auto sout = [&](const char*, const std::size_t sz) {
+		received += sz;
+	};
+
+	subprocess p;
+
+	auto begin = clock_type::now();
+	if (p.start(cd, sout, nullptr) == false)
+		return 0.0;
+	p.join();
+	auto end = clock_type::now();
+
+	if (received != total_bytes)
+		std::cerr << "expected " << total_bytes << " bytes, received " << received << std::endl;
+
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	return double(received) / (1024.0 * 1024.0) / seconds;
+}
+
+void bench_throughput(const std::size_t total_bytes, const std::size_t buffer_size)
+{
+	subprocess::CreateData cd;
+	cd.make_shell("head -c " + std::to_string(total_bytes) + " /dev/zero");
+	cd.buffer_size = buffer_size;
+
+	cd.use_io_uring = false;
+	record("stdout_throughput", "select").value("buffer_size", double(buffer_size)).value("bytes", double(total_bytes)).value("mb_per_s", throughput(cd, total_bytes));
+
+	cd.use_io_uring = true;
+	record("stdout_throughput", "io_uring").value("buffer_size", double(buffer_size)).value("bytes", double(total_bytes)).value("mb_per_s", throughput(cd, total_bytes));
+}
+
+void spawn_latency(const char* name, const subprocess::CreateData& cd, const std::size_t count, const std::size_t rss_mb)
+{
+	std::vector<double> samples;
+	samples.reserve(count);
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		subprocess p;
+
+		auto begin = clock_type::now();
+		bool ok = p.start(cd, nullptr, nullptr);
+		auto end = clock_type::now();
+
+		if (ok == false)
+		{
+			std::cerr << name << ": failed to start" << std::endl;
+			return;
+		}
+		p.join();
+
+		samples.push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+	}
+
+	record r("spawn_latency", name);
+	r.value("parent_rss_mb", double(rss_mb));
+	percentiles(r, samples);
+}
+
+void bench_spawn_latency(subprocess_fork_server& server, const std::size_t count)
+{
+	auto cd = true_command();
+	spawn_latency("posix_spawn", cd, count, 0);
+
+	cd.fork_server = &server;
+	spawn_latency("fork_server", cd, count, 0);
+}
+
+void bench_spawn_strategies(const std::size_t rss_mb, const std::size_t count)
+{
+	// page tables of a large parent are what fork has to copy and vfork/clone avoid
+	std::vector<char> ballast(rss_mb * 1024 * 1024);
+	for (std::size_t i = 0; i < ballast.size(); i += 4096)
+		ballast[i] = char(i);
+
+	auto cd = true_command();
+
+	cd.spawn_strategy = subprocess::spawn_strategy_t::posix_spawn;
+	spawn_latency("posix_spawn", cd, count, rss_mb);
+
+	cd.spawn_strategy = subprocess::spawn_strategy_t::vfork;
+	spawn_latency("vfork", cd, count, rss_mb);
+
+	cd.spawn_strategy = subprocess::spawn_strategy_t::clone_vfork;
+	spawn_latency("clone_vfork", cd, count, rss_mb);
+}
+
+void bench_spawn_rate(const std::size_t count, const std::size_t threads)
+{
+	// start and join /bin/true back to back, the whole round trip is what limits a build or test runner
+	auto cd = true_command();
+
+	std::atomic<std::size_t> failed{ 0 };
+	auto					 worker = [&](const std::size_t n) {
+		for (std::size_t i = 0; i < n; i++)
+		{
+			subprocess p;
+			if (p.start(cd, nullptr, nullptr) == false)
+			{
+				failed++;
+				continue;
+			}
+			p.join();
+		}
+	};
+
+	auto begin = clock_type::now();
+	if (threads == 1)
+	{
+		worker(count);
+	}
+	else
+	{
+		std::vector<std::thread> pool;
+		for (std::size_t t = 0; t < threads; t++)
+			pool.emplace_back(worker, count / threads);
+		for (auto& t : pool)
+			t.join();
+	}
+	double seconds = std::chrono::duration<double>(clock_type::now() - begin).count();
+
+	std::size_t done = threads == 1 ? count : count / threads * threads;
+	record("spawn_rate", threads == 1 ? "serial" : "threads_" + std::to_string(threads))
+		.value("threads", double(threads))
+		.value("spawns", double(done - failed))
+		.value("failed", double(failed))
+		.value("spawns_per_s", double(done - failed) / seconds);
+}
+
+void bench_round_trip(const std::size_t count, const std::size_t message_size)
+{
+	// one message through cat and back, the latency of driving an interactive child
+	std::mutex				m;
+	std::condition_variable cv;
+	std::size_t				received = 0;
+
+	subprocess::CreateData cd;
+	cd.exe = "/bin/cat";
+	cd.argv = { "cat" };
+
+	auto sout = [&](const char*, const std::size_t sz) {
+		std::lock_guard<std::mutex> lock(m);
+		received += sz;
+		cv.notify_one();
+	};
+
+	subprocess p;
+	if (p.start(cd, sout, nullptr) == false)
+	{
+		std::cerr << "round_trip: failed to start" << std::endl;
+		return;
+	}
+
+	std::string			message(message_size, 'x');
+	std::vector<double> samples;
+	samples.reserve(count);
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		auto begin = clock_type::now();
+		if (p.stdin_write(message) == false)
+			break;
+
+		std::unique_lock<std::mutex> lock(m);
+		cv.wait(lock, [&]() { return received >= (i + 1) * message_size; });
+		samples.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - begin).count());
+	}
+
+	p.stdin_close();
+	p.join();
+
+	if (samples.empty())
+		return;
+
+	record r("stdin_round_trip", "cat");
+	r.value("message_size", double(message_size));
+	percentiles(r, samples);
+}
+
+std::size_t zombie_children()
+{
+	//^ children that exited and were never reaped, from the state and parent in /proc/<pid>/stat
+	std::size_t zombies = 0;
+	if (DIR* d = opendir("/proc"))
+	{
+		const std::string self = std::to_string(getpid());
+		while (dirent* e = readdir(d))
+		{
+			if (e->d_name[0] < '0' || e->d_name[0] > '9')
+				continue;
+
+			std::ifstream f(std::string("/proc/") + e->d_name + "/stat");
+			std::string	  line;
+			std::getline(f, line);
+
+			// the command name in parentheses may contain spaces, the fields after it don't
+			auto close = line.rfind(')');
+			if (close == std::string::npos)
+				continue;
+			std::istringstream fields(line.substr(close + 1));
+			std::string		   state, ppid;
+			fields >> state >> ppid;
+			if (state == "Z" && ppid == self)
+				zombies++;
+		}
+		closedir(d);
+	}
+	return zombies;
+}
+
+void bench_kill_to_reap(const std::size_t count)
+{
+	// sleep exits on SIGTERM right away, so this is the signal, exit and reap path without the SIGKILL fallback
+	// kill reaps once the pidfd reports the exit; without pidfd support the zombies are counted below
+	subprocess::CreateData cd;
+	cd.exe = "/bin/sleep";
+	cd.argv = { "sleep", "10" };
+
+	std::vector<double> samples;
+	samples.reserve(count);
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		subprocess p;
+		if (p.start(cd, nullptr, nullptr) == false)
+		{
+			std::cerr << "kill_to_reap: failed to start" << std::endl;
+			return;
+		}
+
+		auto begin = clock_type::now();
+		p.kill();
+		samples.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - begin).count());
+	}
+
+	record r("kill_to_reap", "sigterm");
+	percentiles(r, samples);
+	r.value("zombies", double(zombie_children()));
+}
+
+int main(int argc, char** argv)
+{
+	options opt;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--quick")
+			opt.quick = true;
+		else if (arg.rfind("--filter=", 0) == 0)
+			opt.filter = arg.substr(9);
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--quick] [--filter=name]" << std::endl;
+			return 1;
+		}
+	}
+
+	// forked first, while this process is still small
+	subprocess_fork_server server;
+	server.start();
+
+	if (opt.selected("spawn_latency"))
+		bench_spawn_latency(server, opt.scale(2000));
+
+	if (opt.selected("spawn_rate"))
+	{
+		std::size_t threads = std::max(2u, std::thread::hardware_concurrency());
+		bench_spawn_rate(opt.scale(2000), 1);
+		bench_spawn_rate(opt.scale(2000 * threads), threads);
+	}
+
+	if (opt.selected("stdout_throughput"))
+	{
+		const std::size_t total_bytes = opt.quick ? std::size_t(1) << 26 : std::size_t(1) << 30;
+
+		bench_throughput(total_bytes, 4096);
+		bench_throughput(total_bytes, 65536);
+		bench_throughput(total_bytes, 131072);
+	}
+
+	if (opt.selected("stdin_round_trip"))
+	{
+		bench_round_trip(opt.scale(10000), 64);
+		bench_round_trip(opt.scale(2000), 16384);
+	}
+
+	if (opt.selected("kill_to_reap"))
+		bench_kill_to_reap(opt.scale(1000));
+
+	if (opt.selected("spawn_latency"))
+		bench_spawn_strategies(opt.quick ? 64 : 1024, opt.scale(2000));
+
+	return 0;
+}
@@ -5,9 +5,95 @@
 namespace splib
 {
 
+	struct null_lock
+	{
+		//^ lock policy for objects that are only used from one thread at a time
+		void lock() noexcept
+		{
+		}
+		void unlock() noexcept
+		{
+		}
+	};
+
+	namespace detail
+	{
+		class process_mutex
+		{
+			//^ guards the state of a subprocess; its own mutex unless a basic_subprocess substituted its lock policy
+		public:
+			using lockfunc_t = void (*)(void* lock, bool acquire);
+
+			void lock() noexcept
+			{
+				if (m_func == nullptr)
+					m_mutex.lock();
+				else
+					m_func(m_ctx, true);
+			}
+			void unlock() noexcept
+			{
+				if (m_func == nullptr)
+					m_mutex.unlock();
+				else
+					m_func(m_ctx, false);
+			}
+			void use(lockfunc_t func, void* ctx) noexcept
+			{
+				m_func = func;
+				m_ctx = ctx;
+			}
+
+		protected:
+			std::mutex m_mutex;
+			lockfunc_t m_func = nullptr;
+			void*	   m_ctx = nullptr;
+		};
+	}
+
 	class subprocess
 	{
 	public:
+		enum class spawn_strategy_t
+		{
+			posix_spawn,
+			vfork,
+			clone_vfork,
+			//^ direct clone(CLONE_VM | CLONE_VFORK) on a borrowed stack (linux only)
+		};
+
+		enum class line_overflow_t
+		{
+			split,
+			//^ a long line is delivered in pieces of max_line_length
+			truncate,
+			//^ only the first max_line_length bytes of a long line are delivered
+		};
+
+		struct Redirect
+		{
+			enum class target_t
+			{
+				pipe,
+				//^ a pipe to the parent: output goes to the stdout/stderr function, input comes from stdin_write
+				null,
+				file,
+				descriptor,
+			};
+
+			target_t	target = target_t::pipe;
+			std::string path;
+			//^ for file targets, created if missing
+			bool append = false;
+			//^ for file targets, append instead of truncating
+			int fd = -1;
+			//^ for descriptor targets, owned by the caller and only duplicated into the child
+
+			static Redirect to_null() noexcept;
+			static Redirect to_file(const std::string& path, const bool append = false);
+			static Redirect to_fd(const int fd) noexcept;
+		};
+
 		struct CreateData
 		{
 			std::string				 cwd;
@@ -18,11 +104,160 @@ namespace splib
 			bool make_cmd(const std::string_view& cmdline);
 			bool make_ps(const std::string_view& cmdline);
 
+			bool env_set(const std::string_view& name, const std::string_view& value);
+			bool env_unset(const std::string_view& name);
+			//^ change the environment the child gets on top of the parent's (posix only); false if name is empty or contains '='
+
+			std::shared_ptr<environment_impl> env;
+			//^ copies of CreateData share the overlay and its merged block, env_set/env_unset on a shared overlay copies it first
+			//^ the block holds the parent's environment as it was at the first spawn; later changes to it are not seen until the overlay changes
+
+			bool search_path = false;
+			//^ resolve an exe without '/' through PATH like execvp; lookups are cached until PATH or the found file changes (posix only)
+
+			Redirect stdin_redirect;
+			//^ where the child's stdin comes from (posix only); stdin_write returns false unless this is a pipe
+			Redirect stdout_redirect;
+			Redirect stderr_redirect;
+			//^ where the child's output goes (posix only); redirected streams never reach the stdout/stderr functions
+			//^ if neither stream and no exit function needs it, the process gets no pipes and no buffering thread
+
+			bool merge_stderr = false;
+			//^ the child's stderr is the same descriptor as its stdout, like 2>&1: both arrive at the stdout function or redirect in the order they were written
+			//^ stderr_redirect and stderr_tee are ignored and the stderr function is never called; saves a pipe and its reads
+
+			Redirect stdout_tee;
+			Redirect stderr_tee;
+			//^ a file or descriptor that also receives everything a captured stream delivers to its function (posix only)
+			//^ on linux the copy is made in the kernel with tee/splice, only the function's data is read into userspace
+
+			bool line_mode = false;
+			//^ the stdout/stderr functions get one whole line per call, without its delimiter; an unterminated last line is delivered when the stream ends
+			char line_delimiter = '\n';
+			std::size_t max_line_length = 65536;
+			line_overflow_t line_overflow = line_overflow_t::split;
+			//^ longest line delivered in one call; only a line that spans reads is buffered, never more than this
+
+			std::size_t stdin_high_water = 1024 * 1024;
+			//^ stdin_wait_writable blocks while at least this many bytes queued by stdin_write_async are not yet written
+
 			std::size_t buffer_size = 131072;
-			//^ buffer size for stdout/stderr pipes
+			//^ largest read buffer for stdout/stderr; buffers start at 4KB, double while reads fill them and halve again after a run of small reads
+			//^ with a reactor the loop's shared buffer is used instead, up to this size
+
+			std::size_t pipe_capacity = 0;
+			//^ kernel buffer of the stdin/stdout/stderr pipes set with F_SETPIPE_SZ, 0 keeps the system default (linux only)
+			//^ larger pipes let a chatty child write longer before it blocks and wakes the reader less often
+
+			subprocess_reactor* reactor = nullptr;
+			//^ if set, stdout/stderr are serviced by the reactor threads instead of a dedicated thread (posix only)
+
+			bool use_io_uring = false;
+			//^ without a reactor, drain stdout/stderr through io_uring (linux only); falls back to select if unavailable
+
+			spawn_strategy_t spawn_strategy = spawn_strategy_t::posix_spawn;
+			//^ how the child is created when no fork server is used (posix only)
+
+			subprocess_fork_server* fork_server = nullptr;
+			//^ if set and running, the process is forked by the fork server helper instead of posix_spawn (posix only)
+
+			std::chrono::milliseconds kill_timeout{ 16 };
+			//^ time kill() waits for the process to exit after SIGTERM before sending SIGKILL (posix only)
+
+			std::chrono::milliseconds timeout{ 0 };
+			//^ if set, a process still running this long after start gets SIGTERM, then SIGKILL after kill_timeout; join returns as usual
+			//^ every deadline is served by one shared timer thread, however many processes have one
+		};
+
+		struct PreparedCommand
+		{
+			CreateData data;
+			//^ options can be changed between starts, call prepare again after changing exe or argv
+
+			PreparedCommand() = default;
+			PreparedCommand(const CreateData& cd) noexcept;
+
+			void prepare() noexcept;
+			//^ packs exe and argv of data into a single null terminated block that every start reuses
+
+			const char*	 exe() const noexcept;
+			char* const* argv() const noexcept;
+			//^ views into the prepared block, nullptr before prepare
+
+		protected:
+			friend class subprocess;
+
+			void pack(const CreateData& cd) noexcept;
+
+		protected:
+			std::unique_ptr<char[]> m_block;
+			const char*				m_exe = nullptr;
+		};
+
+		struct CaptureOptions
+		{
+			std::size_t stdout_hint = 0;
+			std::size_t stderr_hint = 0;
+			//^ expected output sizes; a hint that is large enough means one allocation and no copy
+
+			std::size_t max_bytes = std::size_t(-1);
+			//^ most bytes kept per stream, the rest is still read so the child does not block, then dropped
+
+			std::string_view stdin_data;
+			//^ written to stdin before it is closed; stdin is closed right away if empty
+		};
+
+		struct CaptureResult
+		{
+			std::string out;
+			std::string err;
+			int			rc = -1;
+			//^ exit code, -1 if the process could not be started
+
+			bool started = false;
+			bool out_truncated = false;
+			bool err_truncated = false;
+			//^ max_bytes was reached
+		};
+
+		struct JoinResult
+		{
+			int rc = -1;
+
+			std::chrono::nanoseconds wall_time{ 0 };
+			//^ from the spawn until the exit was seen by this library
+
+			bool					  has_usage = false;
+			std::chrono::microseconds user_time{ 0 };
+			std::chrono::microseconds system_time{ 0 };
+			std::int64_t			  max_rss = 0;
+			//^ peak resident set size in bytes
+			std::int64_t voluntary_switches = 0;
+			std::int64_t involuntary_switches = 0;
+			//^ taken from the same wait4 that reaps the child; has_usage is false when it was reaped elsewhere (fork server)
+		};
+
+		struct SinkRef
+		{
+			//^ non owning output callback, func(ctx, data, size) is called for every chunk; ctx has to outlive the process
+			using func_t = void (*)(void* ctx, const char* data, std::size_t sz);
+
+			func_t func = nullptr;
+			void*  ctx = nullptr;
+
+			template <class F>
+			static SinkRef to(F& f) noexcept
+			{
+				SinkRef r;
+				r.func = [](void* ctx, const char* data, const std::size_t sz) { (*static_cast<F*>(ctx))(data, sz); };
+				r.ctx = &f;
+				return r;
+			}
 		};
 
 		using stdfunc_t = std::function<void(const char*, std::size_t)>;
+		using exitfunc_t = std::function<void(int)>;
+		using stdin_donefunc_t = std::function<void(bool)>;
 
 	public:
 		subprocess() noexcept;
@@ -38,33 +273,324 @@ namespace splib
 		bool start(const CreateData& cd, stdfunc_t stdout_func, stdfunc_t stderr_func) noexcept;
 		//^ start process and return true if successful. stdout/stderr functions are called from a separate thread
 
+		bool start(const CreateData& cd, stdfunc_t stdout_func, stdfunc_t stderr_func, exitfunc_t exit_func) noexcept;
+		//^ exit_func is called with the exit code from the same thread as stdout/stderr, after both are drained and the process is reaped
+		//^ join still has to be called to release the process but no longer blocks once exit_func ran; exit_func may be skipped if kill wins the race
+
+		bool start(const PreparedCommand& cmd, stdfunc_t stdout_func, stdfunc_t stderr_func) noexcept;
+		bool start(const PreparedCommand& cmd, stdfunc_t stdout_func, stdfunc_t stderr_func, exitfunc_t exit_func) noexcept;
+		//^ same as above, but argv is taken from the prepared block instead of being copied for every start
+
+		static CaptureResult run_capture(const CreateData& cd) noexcept;
+		static CaptureResult run_capture(const CreateData& cd, const CaptureOptions& options) noexcept;
+		//^ start, collect stdout/stderr and join in one call
+
 		bool joinable() noexcept;
 		//^ returns true if process is started and not joined
 
 		int join() noexcept;
 		//^wait for process to finish and return exit code. stdout/stderr functions are cleared
 
+		int join(JoinResult& result) noexcept;
+		//^ like join, and also reports the child's cpu time, peak memory, context switches and wall time
+
+		bool try_join(int& rc) noexcept;
+		bool try_join(JoinResult& result) noexcept;
+		//^ like join but does not block; returns false if the process is still running or not started
+
+		bool join_for(const std::chrono::milliseconds timeout, int& rc) noexcept;
+		bool join_until(const std::chrono::steady_clock::time_point deadline, int& rc) noexcept;
+		bool join_until(const std::chrono::steady_clock::time_point deadline, JoinResult& result) noexcept;
+		//^ like join but gives up at the deadline and returns false, the process then stays joinable
+
+		int exit_fd() noexcept;
+		//^ pidfd that becomes readable when the process exits, valid until joined or killed; -1 if unsupported or not started
+
 		void stdin_close() noexcept;
-		//^ close stdin pipe. stdin_write will return false after calling this
+		//^ close stdin pipe once queued data is written. stdin_write will return false after calling this
 
 		bool stdin_write(const std::string& data) noexcept;
 		bool stdin_write(const char* bytes, size_t n) noexcept;
 		//^ write returns false after calling stdin_close or if process is not started
+		//^ blocks until every byte is written (after anything queued before it); other calls on this object are not blocked meanwhile
+
+		bool stdin_write_async(std::string data, stdin_donefunc_t done = nullptr) noexcept;
+		//^ queue data and return; it is written with writev as the child reads, by the thread or reactor servicing the process (posix only)
+		//^ done(true) runs once it is written, done(false) if stdin breaks first; returns false if stdin is closed or not started
+		//^ without a background thread (everything redirected and no exit function) this blocks like stdin_write
+
+		bool stdin_feed_fd(const int fd, const std::int64_t offset = 0, const std::size_t len = std::size_t(-1)) noexcept;
+		//^ write len bytes of fd starting at offset, moving them into the pipe with splice so they never pass through this process (linux, posix falls back to pread/write)
+		//^ a negative offset reads from and advances fd's own position; the default len reads to the end of a regular file
+		//^ blocks like stdin_write, fd only has to stay open until it returns; false if fd ends early, stdin breaks or the data is queued behind a closed stdin
+
+		bool stdin_feed_buffer(std::string data, stdin_donefunc_t done = nullptr) noexcept;
+		//^ like stdin_write_async, but large buffers are mapped into the pipe with vmsplice instead of copied (linux only)
+		//^ the string is kept alive after done(true) until the child has read it, or until the process is joined or killed
+
+		std::size_t stdin_pending() noexcept;
+		//^ bytes queued and not yet written
+
+		bool stdin_wait_writable(const std::chrono::milliseconds timeout) noexcept;
+		//^ backpressure: wait until fewer than CreateData::stdin_high_water bytes are pending; false on timeout or if stdin no longer takes data
+
+		bool stdin_flush() noexcept;
+		//^ wait until every queued byte is written; false if some of it could not be
 
 		void kill() noexcept;
 		//^ kill process if started, does nothing otherwise. stdout/stderr functions are cleared
+		//^ waits up to CreateData::kill_timeout for the process to exit on SIGTERM before sending SIGKILL
+		//^ a process seen exiting on SIGTERM through its pidfd is reaped here as well (linux)
 
 		void swap(subprocess& other) noexcept;
 
 	protected:
+		bool start_sinks(const CreateData& cd, const SinkRef& stdout_sink, const SinkRef& stderr_sink, exitfunc_t&& exit_func) noexcept;
+		bool start_command(const CreateData& cd, const PreparedCommand& cmd, stdfunc_t&& stdout_func, stdfunc_t&& stderr_func, exitfunc_t&& exit_func, const SinkRef& stdout_sink, const SinkRef& stderr_sink) noexcept;
+		//^ a sink with a func is used instead of the matching std::function
+
+		std::shared_ptr<pipe_impl> stdin_pipe() noexcept;
+
 		void swap_no_lock(subprocess& other) noexcept;
 		void reset_no_lock() noexcept;
+		std::unique_ptr<suprocess_impl> release_no_lock() noexcept;
+		//^ detaches the process from this object; destroy it after unlocking, its destructor waits for output callbacks that may lock this object
 
 	protected:
-		std::mutex m_process_mutex;
+		detail::process_mutex m_process_mutex;
 
 		std::unique_ptr<suprocess_impl> m_process_handle;
-		std::unique_ptr<pipe_impl>		m_stdin_pipe;
+		std::shared_ptr<pipe_impl>		m_stdin_pipe;
+	};
+
+	template <class Sink, class LockPolicy = std::mutex>
+	class basic_subprocess : public subprocess
+	{
+		//^ subprocess whose stdout/stderr sinks are stored in the object with their static type
+		//^ Sink is either a callable taking (const char*, std::size_t) or a container with append(const char*, std::size_t), like std::string
+		//^ every chunk is a single call through a function pointer into the sink, with no std::function and no allocation
+		//^ LockPolicy replaces the mutex taken by every call; with null_lock nothing is locked and the object must only be used from one thread at a time
+		//^ the output threads hold a pointer to the sinks, so the object can't be moved and must be joined or killed before it is destroyed
+	public:
+		basic_subprocess(Sink stdout_sink = Sink(), Sink stderr_sink = Sink()) noexcept
+			: m_stdout_sink(std::move(stdout_sink))
+			, m_stderr_sink(std::move(stderr_sink))
+		{
+			if constexpr (std::is_same<LockPolicy, std::mutex>::value == false)
+				m_process_mutex.use(&lock_func, &m_lock);
+		}
+		~basic_subprocess() noexcept
+		{
+			SUBPROCESS_ASSERT(joinable() == false);
+			m_process_mutex.use(nullptr, nullptr); // m_lock goes away before the base
+		}
+
+		basic_subprocess(basic_subprocess&&) = delete;
+		basic_subprocess& operator=(basic_subprocess&&) = delete;
+		void swap(subprocess& other) noexcept = delete;
+		//^ would trade the processes but not the sinks they write to
+
+	public:
+		bool start(const CreateData& cd, exitfunc_t exit_func = nullptr) noexcept
+		{
+			return start_sinks(cd, sink_ref(m_stdout_sink), sink_ref(m_stderr_sink), std::move(exit_func));
+		}
+		bool start(const PreparedCommand& cmd, exitfunc_t exit_func = nullptr) noexcept
+		{
+			SUBPROCESS_ASSERT(cmd.exe() != nullptr);
+			return start_command(cmd.data, cmd, nullptr, nullptr, std::move(exit_func), sink_ref(m_stdout_sink), sink_ref(m_stderr_sink));
+		}
+		//^ like subprocess::start, with the output going to the sinks
+
+		Sink& stdout_sink() noexcept
+		{
+			return m_stdout_sink;
+		}
+		Sink& stderr_sink() noexcept
+		{
+			return m_stderr_sink;
+		}
+		//^ written from the output thread while the process runs, safe to use once it is joined
+
+	protected:
+		static SinkRef sink_ref(Sink& sink) noexcept
+		{
+			SinkRef r;
+			r.ctx = &sink;
+			if constexpr (std::is_invocable<Sink&, const char*, std::size_t>::value)
+				r.func = [](void* ctx, const char* data, const std::size_t sz) { (*static_cast<Sink*>(ctx))(data, sz); };
+			else
+				r.func = [](void* ctx, const char* data, const std::size_t sz) { static_cast<Sink*>(ctx)->append(data, sz); };
+			return r;
+		}
+
+		static void lock_func(void* lock, const bool acquire) noexcept
+		{
+			if (acquire)
+				static_cast<LockPolicy*>(lock)->lock();
+			else
+				static_cast<LockPolicy*>(lock)->unlock();
+		}
+
+	protected:
+		Sink	   m_stdout_sink;
+		Sink	   m_stderr_sink;
+		LockPolicy m_lock;
+	};
+
+	class subprocess_reactor
+	{
+	public:
+		subprocess_reactor(const std::size_t thread_count = 1, const std::size_t buffer_size = 131072) noexcept;
+		//^ thread_count event loops drain the output of every process started with this reactor
+		~subprocess_reactor() noexcept;
+		//^ all processes using the reactor must be joined or killed before it is destroyed, and not from inside its callbacks
+
+		subprocess_reactor(const subprocess_reactor&) = delete;
+		subprocess_reactor& operator=(const subprocess_reactor&) = delete;
+
+	public:
+		bool valid() const noexcept;
+		//^ false if the event loops could not be created; processes then fall back to their own thread
+
+		static subprocess_reactor& global() noexcept;
+		//^ process wide reactor with a single loop, created on first use
+
+	protected:
+		friend class subprocess;
+
+		std::unique_ptr<reactor_impl> m_impl;
+	};
+
+	class subprocess_fork_server
+	{
+	public:
+		using entryfunc_t = std::function<int(const std::vector<std::string>&)>;
+
+	public:
+		subprocess_fork_server() noexcept;
+		~subprocess_fork_server() noexcept;
+
+		subprocess_fork_server(const subprocess_fork_server&) = delete;
+		subprocess_fork_server& operator=(const subprocess_fork_server&) = delete;
+
+	public:
+		bool start(entryfunc_t entry = nullptr) noexcept;
+		//^ fork the helper process that will fork every child; call early, while this process is small and single threaded (posix only)
+		//^ with an entry, children started with an empty CreateData::exe run entry(argv) in a fork of the helper instead of exec
+
+		void stop() noexcept;
+		//^ stop the helper; processes it started should be joined first
+
+		bool valid() const noexcept;
+		//^ true while the helper is running
+
+	protected:
+		friend class subprocess;
+
+		std::unique_ptr<fork_server_impl> m_impl;
+		entryfunc_t						  m_entry;
+	};
+
+	class subprocess_pool
+	{
+	public:
+		subprocess_pool(const std::size_t max_running = 0) noexcept;
+		//^ at most max_running processes run at the same time, 0 means one per hardware thread
+		~subprocess_pool() noexcept;
+		//^ waits for every submitted job
+
+		subprocess_pool(const subprocess_pool&) = delete;
+		subprocess_pool& operator=(const subprocess_pool&) = delete;
+
+	public:
+		std::size_t submit(const subprocess::CreateData& cd, subprocess::stdfunc_t stdout_func = nullptr, subprocess::stdfunc_t stderr_func = nullptr, subprocess::exitfunc_t exit_func = nullptr) noexcept;
+		//^ queue a job and return its index in the batch. It starts as soon as a slot is free, from the thread that saw the previous exit
+		//^ callbacks behave as in subprocess::start; exit_func gets -1 if the process could not be started
+
+		std::vector<int> wait() noexcept;
+		//^ wait for every submitted job and return their exit codes in submit order, then start a new batch
+		//^ must not be called concurrently with submit
+
+		std::size_t running() noexcept;
+		//^ number of jobs currently running
+
+	protected:
+		std::unique_ptr<pool_impl> m_impl;
+	};
+
+	class subprocess_pipeline
+	{
+	public:
+		subprocess_pipeline() noexcept;
+		~subprocess_pipeline() noexcept;
+
+		subprocess_pipeline(const subprocess_pipeline&) = delete;
+		subprocess_pipeline& operator=(const subprocess_pipeline&) = delete;
+
+	public:
+		bool start(const std::vector<subprocess::CreateData>& stages, subprocess::stdfunc_t stdout_func, subprocess::stdfunc_t stderr_func) noexcept;
+		//^ start every stage with its stdout connected to the next stage's stdin by a kernel pipe, like `a | b | c` (posix only)
+		//^ stdout_func gets the output of the last stage, stderr_func the stderr of every stage that captures it, one call at a time
+		//^ if a stage can't be started the stages already running are killed and false is returned
+
+		bool joinable() noexcept;
+		//^ returns true if any stage is started and not joined
+
+		std::vector<int> join() noexcept;
+		//^ wait for every stage and return their exit codes in order; must not be called concurrently with start
+
+		void stdin_close() noexcept;
+		bool stdin_write(const std::string& data) noexcept;
+		bool stdin_write(const char* bytes, size_t n) noexcept;
+		//^ stdin of the first stage
+
+		void kill() noexcept;
+		//^ kill every stage
+
+	protected:
+		std::unique_ptr<pipeline_impl> m_impl;
+	};
+
+#ifdef SUBPROCESS_ENABLE_METRICS
+	struct subprocess_metrics
+	{
+		//^ process wide counters from the spawn, output, stdin and join paths; only compiled in with SUBPROCESS_ENABLE_METRICS
+		struct Histogram
+		{
+			static constexpr std::size_t buckets = 32;
+
+			std::uint64_t count = 0;
+			std::uint64_t total_ns = 0;
+			std::uint64_t bucket[buckets] = {};
+			//^ bucket[0] counts samples below 1us, bucket[i] those in [2^(i-1), 2^i) us; the last one also takes anything longer
+		};
+
+		Histogram pipe_setup;
+		//^ creating the stdio pipes of a process
+		Histogram spawn;
+		//^ posix_spawn, vfork, clone or the fork server round trip (CreateProcess on win32)
+		Histogram first_byte;
+		//^ from the spawn to the first byte of each captured stream
+		Histogram callback;
+		//^ time spent in stdout/stderr callbacks, the stream is not read meanwhile
+		Histogram stdin_stall;
+		//^ stdin_write calls that had to wait for the child to read
+		Histogram join_wait;
+		//^ time join blocked for
+
+		std::uint64_t spawns = 0;
+		std::uint64_t spawn_failures = 0;
+		std::uint64_t stdout_bytes = 0;
+		std::uint64_t stderr_bytes = 0;
+		std::uint64_t stdout_callbacks = 0;
+		std::uint64_t stderr_callbacks = 0;
+		std::uint64_t stdin_bytes = 0;
+
+		static subprocess_metrics snapshot() noexcept;
+		//^ every value is read on its own, a snapshot taken while processes run may be off by the updates in flight
+		static void reset() noexcept;
 	};
+#endif
 
 }
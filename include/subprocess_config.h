@@ -2,11 +2,16 @@
 
 #define SUBPROCESS_ENABLE_ASSERT
 #define SUBPROCESS_ENABLE_ASSERT_IMPL /*define for builtin default assert handler; otherwise you need to implement `subprocess_assert_failed`*/
+// #define SUBPROCESS_ENABLE_METRICS /*define to collect `subprocess_metrics`; without it the counters are not compiled in at all*/
 
+#include <cstdint>
 #include <string>
 #include <functional>
 #include <mutex>
 #include <memory>
+#include <chrono>
+#include <vector>
+#include <type_traits>
 
 #if defined(SUBPROCESS_TESTING)
 
@@ -49,5 +54,13 @@ namespace splib
 
 	class suprocess_impl;
 	class pipe_impl;
+	class reactor_impl;
+	class pool_impl;
+	class fork_server_impl;
+	class environment_impl;
+	class pipeline_impl;
+
+	class subprocess_reactor;
+	class subprocess_fork_server;
 
 }
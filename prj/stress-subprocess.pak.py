@@ -0,0 +1,10 @@
+
+
+def configure(cfg):
+	cfg.link("subprocess.pak.py")
+
+def construct(ctx):
+	ctx.config("type","exe")
+
+	ctx.fscan("src: ../stress/")
+
@@ -14,6 +14,7 @@ def construct(ctx):
 
 	if ctx.module_enabled("testing"):
 		ctx.assign("public define:SUBPROCESS_TESTING")
+		ctx.assign("define:SUBPROCESS_ENABLE_METRICS")
 
 	if ctx.module_enabled("dev-platform"):
 		ctx.assign("public define:CLLIO_WITH_DEV_PLATFORM")
@@ -5,6 +5,7 @@ def configure(cfg):
 
 def construct(ctx):
 	ctx.config("type","exe")
+	ctx.assign("define:SUBPROCESS_ENABLE_METRICS")
 
 	ctx.fscan("src: ../test/")
 
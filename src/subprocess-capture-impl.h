@@ -0,0 +1,93 @@
+#pragma once
+
+#include "subprocess.h"
+
+#include <algorithm>
+
+namespace splib
+{
+
+	namespace detail
+	{
+		class capture_buffer
+		{
+			//^ output of one stream, appended into blocks of geometrically growing size and joined once at the end
+			//^ full blocks are never reallocated, so every byte is copied at most twice however the output arrives
+		public:
+			capture_buffer(const std::size_t hint, const std::size_t cap) noexcept
+				: m_next(hint != 0 ? hint : first_block_size), m_cap(cap)
+			{
+			}
+
+			void append(const char* data, std::size_t sz) noexcept
+			{
+				if (sz > m_cap - m_size)
+				{
+					sz = m_cap - m_size;
+					m_truncated = true;
+				}
+
+				while (sz > 0)
+				{
+					if (m_current.size() == m_limit)
+						grow();
+
+					auto n = (std::min)(sz, m_limit - m_current.size());
+					m_current.append(data, n);
+					m_size += n;
+					data += n;
+					sz -= n;
+				}
+			}
+
+			std::string take() noexcept
+			{
+				if (m_blocks.empty())
+					return std::move(m_current); // a right hint ends up here, without a single copy
+
+				std::string result;
+				result.reserve(m_size);
+				for (const auto& b : m_blocks)
+					result += b;
+				result += m_current;
+				return result;
+			}
+
+			bool truncated() const noexcept
+			{
+				return m_truncated;
+			}
+
+		protected:
+			void grow() noexcept
+			{
+				if (m_current.empty() == false)
+				{
+					m_blocks.push_back(std::move(m_current));
+					m_current = std::string();
+				}
+
+				// nothing is allocated for streams that stay empty
+				m_limit = (std::min)(m_next, m_cap - m_size);
+				m_current.reserve(m_limit);
+				m_next = (std::min)(m_next * 2, max_block_size);
+			}
+
+		protected:
+			static constexpr std::size_t first_block_size = 4096;
+			static constexpr std::size_t max_block_size = 64 * 1024 * 1024;
+
+			std::vector<std::string> m_blocks;
+			std::string				 m_current;
+
+			std::size_t m_next;
+			//^ size of the next block
+			std::size_t m_limit = 0;
+			//^ size of the current block
+			std::size_t m_cap;
+			std::size_t m_size = 0;
+			bool		m_truncated = false;
+		};
+	}
+
+}
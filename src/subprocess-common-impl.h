@@ -10,11 +10,70 @@ namespace splib
 		if (data == nullptr || sz == 0)
 			return false;
 
-		std::lock_guard<std::mutex> lock(m_process_mutex);
-		if (m_stdin_pipe == nullptr)
+		// a slow reader must not hold up kill or join from other threads
+		auto pipe = stdin_pipe();
+		return pipe != nullptr && pipe->write(data, sz);
+	}
+
+	bool subprocess::stdin_write_async(std::string data, stdin_donefunc_t done) noexcept
+	{
+		auto pipe = stdin_pipe();
+		if (pipe == nullptr)
+			return false;
+		if (data.empty())
+		{
+			if (done != nullptr)
+				done(true);
+			return true;
+		}
+		return pipe->write_async(std::move(data), std::move(done));
+	}
+
+	bool subprocess::stdin_feed_fd(const int fd, const std::int64_t offset, const std::size_t len) noexcept
+	{
+		if (fd < 0)
 			return false;
 
-		return m_stdin_pipe->write(data, sz);
+		auto pipe = stdin_pipe();
+		return pipe != nullptr && pipe->feed_fd(fd, offset, len);
+	}
+
+	bool subprocess::stdin_feed_buffer(std::string data, stdin_donefunc_t done) noexcept
+	{
+		auto pipe = stdin_pipe();
+		if (pipe == nullptr)
+			return false;
+		if (data.empty())
+		{
+			if (done != nullptr)
+				done(true);
+			return true;
+		}
+		return pipe->write_async(std::move(data), std::move(done), true);
+	}
+
+	std::size_t subprocess::stdin_pending() noexcept
+	{
+		auto pipe = stdin_pipe();
+		return pipe != nullptr ? pipe->pending() : 0;
+	}
+
+	bool subprocess::stdin_wait_writable(const std::chrono::milliseconds timeout) noexcept
+	{
+		auto pipe = stdin_pipe();
+		return pipe != nullptr && pipe->wait_writable(timeout);
+	}
+
+	bool subprocess::stdin_flush() noexcept
+	{
+		auto pipe = stdin_pipe();
+		return pipe != nullptr && pipe->flush();
+	}
+
+	std::shared_ptr<pipe_impl> subprocess::stdin_pipe() noexcept
+	{
+		std::lock_guard<detail::process_mutex> lock(m_process_mutex);
+		return m_stdin_pipe;
 	}
 
 }
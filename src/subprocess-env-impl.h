@@ -0,0 +1,140 @@
+#pragma once
+
+#include "subprocess.h"
+
+#include <cstring>
+#include <map>
+
+namespace splib
+{
+
+	class environment_impl
+	{
+	public:
+		environment_impl() = default;
+		inline environment_impl(const environment_impl& other) noexcept
+			: m_vars(other.m_vars)
+		{
+			//^ only the overlay is copied, the merged block is rebuilt on demand
+		}
+		environment_impl& operator=(const environment_impl&) = delete;
+
+		void set(const std::string_view& name, const std::string_view& value) noexcept
+		{
+			auto& v = m_vars[std::string(name)];
+			v.value = value;
+			v.unset = false;
+			m_block.reset();
+		}
+		void unset(const std::string_view& name) noexcept
+		{
+			auto& v = m_vars[std::string(name)];
+			v.value.clear();
+			v.unset = true;
+			m_block.reset();
+		}
+
+		char* const* envp(char* const* base) noexcept
+		{
+			//^ base with the overlay applied; built on first use and reused by every spawn sharing this overlay
+			//^ base is a snapshot from then on, the parent's later setenv calls reach the child only after env_set/env_unset
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_block == nullptr)
+				build(base);
+			return reinterpret_cast<char* const*>(m_block.get());
+		}
+
+	protected:
+		void build(char* const* base) noexcept
+		{
+			std::vector<const char*> inherited;
+			std::size_t				 count = 0;
+			std::size_t				 strings = 0;
+
+			for (auto e = base; e != nullptr && *e != nullptr; e++)
+			{
+				const char* eq = std::strchr(*e, '=');
+				auto		name = eq != nullptr ? std::string_view(*e, std::size_t(eq - *e)) : std::string_view(*e);
+				if (m_vars.find(name) != m_vars.end())
+					continue;
+
+				inherited.push_back(*e);
+				strings += std::strlen(*e) + 1;
+			}
+			count += inherited.size();
+
+			for (const auto& v : m_vars)
+			{
+				if (v.second.unset)
+					continue;
+				strings += v.first.size() + 1 + v.second.value.size() + 1;
+				count++;
+			}
+
+			// same layout as PreparedCommand: [pointers..., nullptr][name=value\0]...
+			const std::size_t pointers = (count + 1) * sizeof(char*);
+			m_block.reset(new char[pointers + strings]);
+
+			char** envp = reinterpret_cast<char**>(m_block.get());
+			char*  cursor = m_block.get() + pointers;
+
+			for (const char* e : inherited)
+			{
+				std::size_t sz = std::strlen(e) + 1;
+				std::memcpy(cursor, e, sz);
+				*envp++ = cursor;
+				cursor += sz;
+			}
+			for (const auto& v : m_vars)
+			{
+				if (v.second.unset)
+					continue;
+
+				*envp++ = cursor;
+				std::memcpy(cursor, v.first.data(), v.first.size());
+				cursor += v.first.size();
+				*cursor++ = '=';
+				std::memcpy(cursor, v.second.value.c_str(), v.second.value.size() + 1);
+				cursor += v.second.value.size() + 1;
+			}
+			*envp = nullptr;
+		}
+
+	protected:
+		struct var
+		{
+			std::string value;
+			bool		unset = false;
+		};
+
+		std::map<std::string, var, std::less<>> m_vars;
+
+		std::mutex				m_mutex;
+		std::unique_ptr<char[]> m_block;
+	};
+
+	namespace detail
+	{
+		inline const char* env_lookup(char* const* envp, const std::string_view& name) noexcept
+		{
+			//^ value of name in an envp block, nullptr if it is not set
+			for (auto e = envp; e != nullptr && *e != nullptr; e++)
+			{
+				if (std::strncmp(*e, name.data(), name.size()) == 0 && (*e)[name.size()] == '=')
+					return *e + name.size() + 1;
+			}
+			return nullptr;
+		}
+
+		inline environment_impl& unshare(std::shared_ptr<environment_impl>& env) noexcept
+		{
+			//^ copy on write, other CreateData instances keep the overlay and block they already share
+			if (env == nullptr)
+				env = std::make_shared<environment_impl>();
+			else if (env.use_count() > 1)
+				env = std::make_shared<environment_impl>(*env);
+			return *env;
+		}
+	}
+
+}
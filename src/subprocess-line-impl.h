@@ -0,0 +1,165 @@
+#pragma once
+
+#include "subprocess.h"
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	include <emmintrin.h>
+#	define SUBPROCESS_HAS_SSE2
+#endif
+#if defined(__AVX2__)
+#	include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#endif
+
+namespace splib
+{
+
+	namespace detail
+	{
+		inline unsigned lowest_bit(const unsigned mask) noexcept
+		{
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return unsigned(index);
+#else
+			return unsigned(__builtin_ctz(mask));
+#endif
+		}
+
+		inline const char* find_delimiter(const char* p, const char* const end, const char delimiter) noexcept
+		{
+			//^ first delimiter in [p, end) or nullptr; compares 32 or 16 bytes at a time where the target allows it
+#if defined(__AVX2__)
+			const __m256i wide = _mm256_set1_epi8(delimiter);
+			for (; end - p >= 32; p += 32)
+			{
+				auto mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), wide)));
+				if (mask != 0)
+					return p + lowest_bit(mask);
+			}
+#endif
+#if defined(SUBPROCESS_HAS_SSE2)
+			const __m128i narrow = _mm_set1_epi8(delimiter);
+			for (; end - p >= 16; p += 16)
+			{
+				auto mask = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), narrow)));
+				if (mask != 0)
+					return p + lowest_bit(mask);
+			}
+#endif
+			if (p >= end)
+				return nullptr;
+			return static_cast<const char*>(std::memchr(p, delimiter, std::size_t(end - p)));
+		}
+
+		class line_framer
+		{
+			//^ cuts a stream into lines for the target sink; lines inside a read buffer are passed on in place,
+			//^ only a line that spans reads is gathered in the carry buffer, which never grows past max_length
+		public:
+			line_framer(const subprocess::SinkRef& target, const subprocess::CreateData& cd) noexcept
+				: m_target(target), m_delimiter(cd.line_delimiter), m_max_length(cd.max_line_length != 0 ? cd.max_line_length : 1), m_overflow(cd.line_overflow)
+			{
+			}
+
+			void operator()(const char* data, const std::size_t sz) noexcept
+			{
+				const char* const end = data + sz;
+				while (data < end)
+				{
+					const char* found = find_delimiter(data, end, m_delimiter);
+					if (found == nullptr)
+					{
+						keep(data, std::size_t(end - data));
+						return;
+					}
+
+					if (m_carry.empty() && m_dropping == false)
+					{
+						line(data, std::size_t(found - data));
+					}
+					else
+					{
+						keep(data, std::size_t(found - data));
+						line(m_carry.data(), m_carry.size());
+						m_carry.clear();
+					}
+					m_dropping = false;
+					data = found + 1;
+				}
+			}
+
+			void finish() noexcept
+			{
+				//^ the stream ended, a last line without delimiter is still a line
+				if (m_carry.empty() == false)
+					line(m_carry.data(), m_carry.size());
+				m_carry.clear();
+				m_dropping = false;
+			}
+
+		protected:
+			void line(const char* data, std::size_t sz) noexcept
+			{
+				if (m_overflow == subprocess::line_overflow_t::truncate)
+				{
+					m_target.func(m_target.ctx, data, std::min(sz, m_max_length));
+					return;
+				}
+
+				while (sz > m_max_length)
+				{
+					m_target.func(m_target.ctx, data, m_max_length);
+					data += m_max_length;
+					sz -= m_max_length;
+				}
+				m_target.func(m_target.ctx, data, sz);
+			}
+
+			void keep(const char* data, std::size_t sz) noexcept
+			{
+				//^ part of a line that continues in the next read
+				while (sz > 0 && m_dropping == false)
+				{
+					auto room = m_max_length - m_carry.size();
+					if (sz <= room)
+					{
+						m_carry.append(data, sz);
+						return;
+					}
+
+					m_carry.append(data, room);
+					data += room;
+					sz -= room;
+
+					// the carry is full: a split line goes on in a new piece, a truncated one ignores the rest
+					if (m_overflow == subprocess::line_overflow_t::split)
+					{
+						line(m_carry.data(), m_carry.size());
+						m_carry.clear();
+					}
+					else
+					{
+						m_dropping = true;
+					}
+				}
+			}
+
+		protected:
+			subprocess::SinkRef				m_target;
+			char							m_delimiter;
+			std::size_t						m_max_length;
+			subprocess::line_overflow_t		m_overflow;
+
+			std::string m_carry;
+			bool		m_dropping = false;
+			//^ a truncated line is full, the rest of it is skipped up to its delimiter
+		};
+	}
+
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "subprocess.h"
+
+#ifdef SUBPROCESS_ENABLE_METRICS
+#	include <atomic>
+#endif
+
+namespace splib
+{
+
+	namespace detail
+	{
+		enum class metric_t
+		{
+			pipe_setup,
+			spawn,
+			first_byte,
+			callback,
+			stdin_stall,
+			join_wait,
+			count
+		};
+
+		enum class counter_t
+		{
+			spawns,
+			spawn_failures,
+			stdout_bytes,
+			stderr_bytes,
+			stdout_callbacks,
+			stderr_callbacks,
+			stdin_bytes,
+			count
+		};
+
+#ifdef SUBPROCESS_ENABLE_METRICS
+
+		class metrics_registry
+		{
+			//^ process wide, every update is a relaxed atomic add so the hot paths never take a lock
+		public:
+			using clock_t = std::chrono::steady_clock;
+
+			void record(const metric_t m, const clock_t::duration elapsed) noexcept
+			{
+				auto  ns = std::uint64_t(std::max(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::int64_t(0)));
+				auto& h = m_histograms[std::size_t(m)];
+				h.count.fetch_add(1, std::memory_order_relaxed);
+				h.total_ns.fetch_add(ns, std::memory_order_relaxed);
+				h.bucket[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+			}
+			void count(const counter_t c, const std::uint64_t n) noexcept
+			{
+				m_counters[std::size_t(c)].fetch_add(n, std::memory_order_relaxed);
+			}
+
+			void read(const metric_t m, subprocess_metrics::Histogram& result) const noexcept
+			{
+				auto& h = m_histograms[std::size_t(m)];
+				result.count = h.count.load(std::memory_order_relaxed);
+				result.total_ns = h.total_ns.load(std::memory_order_relaxed);
+				for (std::size_t i = 0; i < subprocess_metrics::Histogram::buckets; i++)
+					result.bucket[i] = h.bucket[i].load(std::memory_order_relaxed);
+			}
+			std::uint64_t read(const counter_t c) const noexcept
+			{
+				return m_counters[std::size_t(c)].load(std::memory_order_relaxed);
+			}
+
+			void reset() noexcept
+			{
+				for (auto& h : m_histograms)
+				{
+					h.count.store(0, std::memory_order_relaxed);
+					h.total_ns.store(0, std::memory_order_relaxed);
+					for (auto& b : h.bucket)
+						b.store(0, std::memory_order_relaxed);
+				}
+				for (auto& c : m_counters)
+					c.store(0, std::memory_order_relaxed);
+			}
+
+			static metrics_registry& global() noexcept
+			{
+				static metrics_registry registry;
+				return registry;
+			}
+
+		protected:
+			static std::size_t bucket_of(const std::uint64_t ns) noexcept
+			{
+				// bucket i holds [2^(i-1), 2^i) microseconds, 0 everything below a microsecond
+				std::size_t i = 0;
+				for (auto us = ns / 1000; us != 0 && i + 1 < subprocess_metrics::Histogram::buckets; us >>= 1)
+					i++;
+				return i;
+			}
+
+			struct histogram
+			{
+				std::atomic<std::uint64_t> count{ 0 };
+				std::atomic<std::uint64_t> total_ns{ 0 };
+				std::atomic<std::uint64_t> bucket[subprocess_metrics::Histogram::buckets] = {};
+			};
+
+			histogram				   m_histograms[std::size_t(metric_t::count)];
+			std::atomic<std::uint64_t> m_counters[std::size_t(counter_t::count)] = {};
+		};
+
+		class stopwatch
+		{
+			//^ started on construction; record adds the time since then to a histogram
+		public:
+			void record(const metric_t m) const noexcept
+			{
+				metrics_registry::global().record(m, metrics_registry::clock_t::now() - m_begin);
+			}
+			metrics_registry::clock_t::time_point started() const noexcept
+			{
+				return m_begin;
+			}
+
+		protected:
+			metrics_registry::clock_t::time_point m_begin = metrics_registry::clock_t::now();
+		};
+
+		inline void count(const counter_t c, const std::uint64_t n = 1) noexcept
+		{
+			metrics_registry::global().count(c, n);
+		}
+
+		class stream_metrics
+		{
+			//^ per output stream: bytes and callbacks, and the first byte after the spawn
+		public:
+			void arm(const bool is_stderr, const std::chrono::steady_clock::time_point started) noexcept
+			{
+				m_stderr = is_stderr;
+				m_started = started;
+				m_waiting = true;
+			}
+			void delivered(const std::size_t sz) noexcept
+			{
+				count(m_stderr ? counter_t::stderr_bytes : counter_t::stdout_bytes, sz);
+				count(m_stderr ? counter_t::stderr_callbacks : counter_t::stdout_callbacks);
+				if (m_waiting)
+				{
+					m_waiting = false;
+					metrics_registry::global().record(metric_t::first_byte, std::chrono::steady_clock::now() - m_started);
+				}
+			}
+
+		protected:
+			std::chrono::steady_clock::time_point m_started;
+			bool								  m_stderr = false;
+			bool								  m_waiting = false;
+		};
+
+#else
+
+		class stopwatch
+		{
+		public:
+			void record(const metric_t) const noexcept
+			{
+			}
+			std::chrono::steady_clock::time_point started() const noexcept
+			{
+				return std::chrono::steady_clock::time_point();
+			}
+		};
+
+		inline void count(const counter_t, const std::uint64_t = 1) noexcept
+		{
+		}
+
+		class stream_metrics
+		{
+		public:
+			void arm(const bool, const std::chrono::steady_clock::time_point) noexcept
+			{
+			}
+			void delivered(const std::size_t) noexcept
+			{
+			}
+		};
+
+#endif
+	}
+
+}
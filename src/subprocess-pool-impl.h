@@ -0,0 +1,208 @@
+#pragma once
+
+#include "subprocess.h"
+
+#include <deque>
+#include <thread>
+#include <condition_variable>
+
+namespace splib
+{
+
+	class pool_impl
+	{
+	protected:
+		struct job
+		{
+			subprocess::CreateData cd;
+			subprocess::stdfunc_t  stdout_func;
+			subprocess::stdfunc_t  stderr_func;
+			subprocess::exitfunc_t exit_func;
+
+			subprocess process;
+
+			int	 rc = -1;
+			bool launched = false;
+			bool exited = false;
+		};
+
+	public:
+		inline pool_impl(const std::size_t max_running) noexcept
+			: m_max_running(max_running != 0 ? max_running : (std::max)(std::size_t(std::thread::hardware_concurrency()), std::size_t(1)))
+		{
+			m_reaper = std::thread([this]() {
+				this->reap_loop();
+			});
+		}
+		inline ~pool_impl()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				SUBPROCESS_ASSERT(m_reaped == m_jobs.size());
+				m_stopping = true;
+			}
+			m_reap_cv.notify_one();
+			m_reaper.join();
+		}
+
+		std::size_t submit(const subprocess::CreateData& cd, subprocess::stdfunc_t&& stdout_func, subprocess::stdfunc_t&& stderr_func, subprocess::exitfunc_t&& exit_func) noexcept
+		{
+			job*		j = nullptr;
+			std::size_t index;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+
+				index = m_jobs.size();
+				m_jobs.emplace_back();
+
+				job& added = m_jobs.back();
+				added.cd = cd;
+				added.stdout_func = std::move(stdout_func);
+				added.stderr_func = std::move(stderr_func);
+				added.exit_func = std::move(exit_func);
+
+				if (m_running < m_max_running)
+					j = claim_no_lock();
+			}
+
+			launch(j);
+			return index;
+		}
+
+		std::vector<int> wait() noexcept
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done_cv.wait(lock, [this]() { return m_reaped == m_jobs.size(); });
+
+			std::vector<int> result;
+			result.reserve(m_jobs.size());
+			for (const auto& j : m_jobs)
+				result.push_back(j.rc);
+
+			m_jobs.clear();
+			m_next = 0;
+			m_reaped = 0;
+			return result;
+		}
+
+		std::size_t running() noexcept
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_running;
+		}
+
+	protected:
+		job* claim_no_lock() noexcept
+		{
+			//^ take the next queued job and occupy a slot for it, nullptr if the queue is empty
+			if (m_next == m_jobs.size())
+				return nullptr;
+
+			m_running++;
+			return &m_jobs[m_next++];
+		}
+
+		void launch(job* j) noexcept
+		{
+			// jobs that fail to start free their slot right away, keep going until one starts
+			while (j != nullptr)
+			{
+				auto on_exit = [this, j](const int rc) {
+					this->job_exited(*j, rc);
+				};
+
+				bool ok = j->process.start(j->cd, std::move(j->stdout_func), std::move(j->stderr_func), on_exit);
+				if (ok == false && j->exit_func != nullptr)
+					j->exit_func(-1);
+
+				std::lock_guard<std::mutex> lock(m_mutex);
+				j->launched = true;
+
+				if (ok)
+				{
+					if (j->exited)
+						retire_no_lock(*j);
+					return;
+				}
+
+				j->rc = -1;
+				j->exited = true;
+				m_reaped++;
+				m_running--;
+				m_done_cv.notify_all();
+
+				j = claim_no_lock();
+			}
+		}
+
+		void job_exited(job& j, const int rc) noexcept
+		{
+			//^ called from the thread that observed the exit, which also starts the next job
+			if (j.exit_func != nullptr)
+				j.exit_func(rc);
+
+			job* next;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				j.rc = rc;
+				j.exited = true;
+				if (j.launched)
+					retire_no_lock(j);
+
+				m_running--;
+				next = claim_no_lock();
+			}
+
+			launch(next);
+		}
+
+		void retire_no_lock(job& j) noexcept
+		{
+			// the exit callback runs on the process' own buffering thread, so joining happens elsewhere
+			m_finished.push_back(&j);
+			m_reap_cv.notify_one();
+		}
+
+		void reap_loop() noexcept
+		{
+			std::vector<job*> finished;
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_reap_cv.wait(lock, [this]() { return m_stopping || m_finished.empty() == false; });
+					if (m_finished.empty())
+						return;
+					finished.swap(m_finished);
+				}
+
+				for (auto* j : finished)
+					j->process.join(); // exit code is already known, this only releases the process
+
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_reaped += finished.size();
+				}
+				m_done_cv.notify_all();
+				finished.clear();
+			}
+		}
+
+	protected:
+		const std::size_t m_max_running;
+
+		std::mutex				m_mutex;
+		std::condition_variable m_reap_cv;
+		std::condition_variable m_done_cv;
+
+		std::deque<job>	  m_jobs;
+		std::size_t		  m_next = 0;
+		std::size_t		  m_running = 0;
+		std::size_t		  m_reaped = 0;
+		std::vector<job*> m_finished;
+		bool			  m_stopping = false;
+
+		std::thread m_reaper;
+	};
+
+}
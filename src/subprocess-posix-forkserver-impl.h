@@ -0,0 +1,488 @@
+#pragma once
+
+#include "subprocess.h"
+
+#include <cstring>
+#include <unordered_map>
+
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+
+extern char** environ;
+
+namespace splib
+{
+
+	namespace detail
+	{
+		struct fork_server_message
+		{
+			enum kind_t : std::uint32_t
+			{
+				spawn_request,
+				spawn_reply,
+				exited
+			};
+
+			std::uint32_t kind = spawn_request;
+			std::int32_t  pid = 0;
+			//^ environment size for requests, 0 keeps the helper's environment
+			std::int32_t  value = 0;
+			//^ errno for replies, wait status for exits, argument count for requests
+		};
+
+		constexpr std::size_t fork_server_max_message = 256 * 1024;
+
+		inline bool send_with_fds(const int sock, const void* data, const std::size_t sz, const int* fds, const std::size_t fd_count) noexcept
+		{
+			iovec iov;
+			iov.iov_base = const_cast<void*>(data);
+			iov.iov_len = sz;
+
+			msghdr msg;
+			std::memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+
+			alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 3)];
+			if (fd_count > 0)
+			{
+				SUBPROCESS_ASSERT(fd_count <= 3);
+
+				msg.msg_control = control;
+				msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+				cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+				cmsg->cmsg_level = SOL_SOCKET;
+				cmsg->cmsg_type = SCM_RIGHTS;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+				std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+			}
+
+			ssize_t r;
+			do
+			{
+				r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+			} while (r == -1 && errno == EINTR);
+
+			return r == ssize_t(sz);
+		}
+
+		class fork_server_helper
+		{
+			//^ runs inside the forked helper process and never returns
+		public:
+			inline fork_server_helper(const int sock, const subprocess_fork_server::entryfunc_t& entry) noexcept
+				: m_sock(sock)
+				, m_entry(entry)
+			{
+			}
+
+			[[noreturn]] void run() noexcept
+			{
+				isolate();
+
+				pollfd fds[2];
+				fds[0].fd = m_sock;
+				fds[0].events = POLLIN;
+				fds[1].fd = m_sigchld;
+				fds[1].events = POLLIN;
+
+				std::unique_ptr<char[]> buffer(new char[fork_server_max_message]);
+
+				while (true)
+				{
+					if (poll(fds, 2, -1) == -1)
+					{
+						if (errno == EINTR)
+							continue;
+						_exit(1);
+					}
+
+					if (fds[1].revents != 0)
+						reap();
+
+					if (fds[0].revents != 0)
+					{
+						if (serve(buffer.get()) == false)
+							_exit(0); // the parent is gone
+					}
+				}
+			}
+
+		protected:
+			void isolate() noexcept
+			{
+				// keep nothing from the parent but the control socket and /dev/null as stdio
+				int null_fd = open("/dev/null", O_RDWR);
+				for (int i = 0; i < 3; i++)
+					dup2(null_fd, i);
+
+				if (m_sock != 3)
+				{
+					dup3(m_sock, 3, O_CLOEXEC);
+					m_sock = 3;
+				}
+#ifdef SYS_close_range
+				if (syscall(SYS_close_range, 4, ~0U, 0) != 0)
+#endif
+				{
+					for (int fd = 4, max_fd = int(sysconf(_SC_OPEN_MAX)); fd < max_fd; fd++)
+						close(fd);
+				}
+
+				sigset_t mask;
+				sigemptyset(&mask);
+				sigaddset(&mask, SIGCHLD);
+				sigprocmask(SIG_BLOCK, &mask, &m_child_mask);
+				sigdelset(&m_child_mask, SIGCHLD);
+
+				m_sigchld = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+			}
+
+			bool serve(char* buffer) noexcept
+			{
+				iovec iov;
+				iov.iov_base = buffer;
+				iov.iov_len = fork_server_max_message;
+
+				alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 3)];
+
+				msghdr msg;
+				std::memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				msg.msg_control = control;
+				msg.msg_controllen = sizeof(control);
+
+				auto r = recvmsg(m_sock, &msg, MSG_CMSG_CLOEXEC);
+				if (r == -1)
+					return errno == EINTR || errno == EAGAIN;
+				if (r == 0)
+					return false;
+
+				int stdio[3] = { -1, -1, -1 };
+				for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+				{
+					if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(stdio)))
+						std::memcpy(stdio, CMSG_DATA(cmsg), sizeof(stdio));
+				}
+
+				fork_server_message reply;
+				reply.kind = fork_server_message::spawn_reply;
+				reply.value = EINVAL;
+
+				if (std::size_t(r) > sizeof(fork_server_message) && stdio[0] != -1 && (msg.msg_flags & MSG_TRUNC) == 0)
+					reply.pid = spawn(buffer, std::size_t(r), stdio, reply.value);
+
+				for (int fd : stdio)
+				{
+					if (fd != -1)
+						close(fd);
+				}
+
+				return send_with_fds(m_sock, &reply, sizeof(reply), nullptr, 0);
+			}
+
+			pid_t spawn(const char* buffer, const std::size_t sz, const int* stdio, std::int32_t& error) noexcept
+			{
+				// payload: cwd, exe, argv and the environment as consecutive null terminated strings
+				fork_server_message request;
+				std::memcpy(&request, buffer, sizeof(request));
+
+				std::vector<const char*> strings;
+				for (std::size_t i = sizeof(request); i < sz; i += std::strlen(buffer + i) + 1)
+					strings.push_back(buffer + i);
+				if (buffer[sz - 1] != '\0' || request.value < 0 || request.pid < 0 || strings.size() != std::size_t(request.value) + std::size_t(request.pid) + 2)
+					return 0;
+
+				const char* cwd = strings[0];
+				const char* exe = strings[1];
+
+				std::vector<char*> argv;
+				std::vector<char*> envp;
+				for (std::size_t i = 2; i < strings.size(); i++)
+				{
+					auto& list = i < std::size_t(request.value) + 2 ? argv : envp;
+					list.push_back(const_cast<char*>(strings[i]));
+				}
+				argv.push_back(nullptr);
+				envp.push_back(nullptr);
+
+				// reports exec failures back, end of file means exec went through
+				pipe_handle status;
+				if (status.open_pipe() == false)
+				{
+					error = errno;
+					return 0;
+				}
+
+				pid_t pid = fork();
+				if (pid == 0)
+				{
+					sigprocmask(SIG_SETMASK, &m_child_mask, nullptr);
+
+					int e = 0;
+					for (int i = 0; i < 3 && e == 0; i++)
+					{
+						if (dup2(stdio[i], i) == -1)
+							e = errno;
+					}
+					if (e == 0 && cwd[0] != '\0' && chdir(cwd) == -1)
+						e = errno;
+
+					if (e == 0 && exe[0] == '\0' && m_entry != nullptr)
+					{
+						// without an exec nothing closes the helper's close on exec descriptors, the entry function gets stdio only
+						status.close_pipe();
+						close(m_sock);
+						close(m_sigchld);
+						for (int i = 0; i < 3; i++)
+						{
+							if (stdio[i] > 2)
+								close(stdio[i]);
+						}
+
+						if (request.pid > 0)
+						{
+							clearenv();
+							for (std::size_t i = 0; envp[i] != nullptr; i++)
+								putenv(envp[i]);
+						}
+
+						std::vector<std::string> args(argv.begin(), argv.end() - 1);
+						_exit(m_entry(args));
+					}
+
+					if (e == 0)
+					{
+						execve(exe, argv.data(), request.pid > 0 ? envp.data() : environ);
+						e = errno;
+					}
+
+					::write(status.handles[1], &e, sizeof(e));
+					_exit(127);
+				}
+
+				status.close_write();
+
+				if (pid == -1)
+				{
+					error = errno;
+					status.close_read();
+					return 0;
+				}
+
+				int		e = 0;
+				ssize_t r;
+				do
+				{
+					r = ::read(status.handles[0], &e, sizeof(e));
+				} while (r == -1 && errno == EINTR);
+				status.close_read();
+
+				if (r == sizeof(e))
+				{
+					// the child never got to run anything, it exits right away
+					waitpid(pid, nullptr, 0);
+					error = e;
+					return 0;
+				}
+
+				error = 0;
+				return pid;
+			}
+
+			void reap() noexcept
+			{
+				signalfd_siginfo info;
+				while (::read(m_sigchld, &info, sizeof(info)) > 0)
+				{
+				}
+
+				int	  status;
+				pid_t pid;
+				while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+				{
+					fork_server_message msg;
+					msg.kind = fork_server_message::exited;
+					msg.pid = pid;
+					msg.value = status;
+					send_with_fds(m_sock, &msg, sizeof(msg), nullptr, 0);
+				}
+			}
+
+		protected:
+			int										   m_sock;
+			int										   m_sigchld = -1;
+			sigset_t								   m_child_mask;
+			const subprocess_fork_server::entryfunc_t& m_entry;
+		};
+	}
+
+	class fork_server_impl
+	{
+	public:
+		inline ~fork_server_impl()
+		{
+			stop();
+		}
+
+		bool start(const subprocess_fork_server::entryfunc_t& entry) noexcept
+		{
+			SUBPROCESS_ASSERT(m_sock == -1);
+
+			int socks[2];
+			if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == -1)
+				return false;
+
+			m_helper = fork();
+			if (m_helper == 0)
+			{
+				close(socks[0]);
+				detail::fork_server_helper(socks[1], entry).run();
+			}
+
+			close(socks[1]);
+			if (m_helper == -1)
+			{
+				close(socks[0]);
+				return false;
+			}
+
+			m_sock = socks[0];
+			m_failed = false;
+			m_reader = std::thread([this]() {
+				this->read_loop();
+			});
+			return true;
+		}
+
+		void stop() noexcept
+		{
+			if (m_sock == -1)
+				return;
+
+			// the helper exits once it sees the socket close
+			shutdown(m_sock, SHUT_RDWR);
+			m_reader.join();
+			close(m_sock);
+			m_sock = -1;
+
+			detail::wait_exit(m_helper);
+			m_helper = 0;
+		}
+
+		bool valid() noexcept
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_sock != -1 && m_failed == false;
+		}
+
+		std::shared_ptr<detail::exit_state> spawn(const subprocess::CreateData& cd, const char* exe, char* const* envp, const int* stdio, pid_t& pid) noexcept
+		{
+			//^ returns the state that receives the exit status, nullptr if the process could not be started
+			//^ a null envp keeps the helper's environment
+			std::string payload(sizeof(detail::fork_server_message), '\0');
+
+			detail::fork_server_message request;
+			request.kind = detail::fork_server_message::spawn_request;
+			request.value = std::int32_t(cd.argv.size());
+
+			payload.append(cd.cwd).push_back('\0');
+			payload.append(exe).push_back('\0');
+			for (const auto& a : cd.argv)
+				payload.append(a).push_back('\0');
+			for (auto e = envp; e != nullptr && *e != nullptr; e++, request.pid++)
+				payload.append(*e).push_back('\0');
+			std::memcpy(&payload[0], &request, sizeof(request));
+
+			if (payload.size() > detail::fork_server_max_message)
+				return nullptr;
+
+			// the helper serves one request at a time, replies come back in order
+			std::lock_guard<std::mutex> request_lock(m_request_mutex);
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_failed)
+					return nullptr;
+				m_replied = false;
+			}
+
+			if (detail::send_with_fds(m_sock, payload.data(), payload.size(), stdio, 3) == false)
+				return nullptr;
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_reply_cv.wait(lock, [this]() { return m_replied || m_failed; });
+			if (m_failed || m_reply_pid <= 0)
+				return nullptr;
+
+			pid = m_reply_pid;
+			return m_reply_state;
+		}
+
+	protected:
+		void read_loop() noexcept
+		{
+			detail::fork_server_message msg;
+			while (true)
+			{
+				auto r = recv(m_sock, &msg, sizeof(msg), 0);
+				if (r == -1 && errno == EINTR)
+					continue;
+				if (r != sizeof(msg))
+					break;
+
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (msg.kind == detail::fork_server_message::spawn_reply)
+				{
+					m_reply_pid = msg.pid;
+					m_reply_state = nullptr;
+					if (msg.pid > 0)
+					{
+						// registered before the helper can report the exit, messages arrive in order
+						m_reply_state = std::make_shared<detail::exit_state>();
+						m_running.emplace(msg.pid, m_reply_state);
+					}
+					m_replied = true;
+					m_reply_cv.notify_all();
+				}
+				else if (msg.kind == detail::fork_server_message::exited)
+				{
+					auto itr = m_running.find(msg.pid);
+					if (itr != m_running.end())
+					{
+						itr->second->set(detail::exit_code(msg.value));
+						m_running.erase(itr);
+					}
+				}
+			}
+
+			// helper is gone, nothing will report these anymore
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_failed = true;
+			for (auto& p : m_running)
+				p.second->set(-1);
+			m_running.clear();
+			m_reply_cv.notify_all();
+		}
+
+	protected:
+		int			m_sock = -1;
+		pid_t		m_helper = 0;
+		std::thread m_reader;
+
+		std::mutex				m_request_mutex;
+		std::mutex				m_mutex;
+		std::condition_variable m_reply_cv;
+
+		bool								m_failed = false;
+		bool								m_replied = false;
+		pid_t								m_reply_pid = 0;
+		std::shared_ptr<detail::exit_state> m_reply_state;
+
+		std::unordered_map<pid_t, std::shared_ptr<detail::exit_state>> m_running;
+	};
+
+}
@@ -1,13 +1,29 @@
 #pragma once
 
 #include "subprocess.h"
+#include "subprocess-line-impl.h"
+#include "subprocess-timer-impl.h"
+#include "subprocess-metrics-impl.h"
 
 #include <thread>
 #include <chrono>
+#include <condition_variable>
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
 
 #include <fcntl.h>
 #include <spawn.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 namespace splib
@@ -22,12 +38,26 @@ namespace splib
 			inline ~pipe_handle() noexcept
 			{
 			}
-			void close_pipe() noexcept
+			bool open_pipe() noexcept
+			{
+				return pipe2(handles, O_CLOEXEC) == 0;
+			}
+			void close_read() noexcept
 			{
-				if (handles[1] != -1)
-					close(handles[1]);
 				if (handles[0] != -1)
 					close(handles[0]);
+				handles[0] = -1;
+			}
+			void close_write() noexcept
+			{
+				if (handles[1] != -1)
+					close(handles[1]);
+				handles[1] = -1;
+			}
+			void close_pipe() noexcept
+			{
+				close_write();
+				close_read();
 			}
 
 			pipe_handle() = default;
@@ -35,107 +65,902 @@ namespace splib
 			pipe_handle& operator=(const pipe_handle&) = delete;
 		};
 
+		class read_buffer
+		{
+			//^ grows while reads fill it and shrinks back after a run of small reads or a quiet spell, so idle children hold little memory
+		public:
+			read_buffer(const std::size_t max_size) noexcept
+				: m_max(std::max(max_size, std::size_t(1)))
+				, m_min(std::min(m_max, initial_size))
+				, m_size(m_min)
+			{
+			}
+
+			char* data() noexcept
+			{
+				if (m_data == nullptr)
+					m_data.reset(new char[m_size]);
+				return m_data.get();
+			}
+			std::size_t size() const noexcept
+			{
+				return m_size;
+			}
+
+			void update(const ssize_t num) noexcept
+			{
+				//^ called with the result of every read into the buffer, while no read is using it
+				if (num <= 0)
+					return;
+
+				if (std::size_t(num) == m_size && m_size < m_max)
+				{
+					resize(std::min(m_size * 2, m_max));
+				}
+				else if (std::size_t(num) <= m_size / 4 && m_size > m_min)
+				{
+					if (++m_small_reads == shrink_after)
+						resize(m_size / 2);
+					return;
+				}
+				m_small_reads = 0;
+			}
+
+			int idle_timeout() const noexcept
+			{
+				//^ how long a poll may wait before idle should be called, -1 while there is nothing to give back
+				return m_size > m_min ? idle_after_ms : -1;
+			}
+			void idle() noexcept
+			{
+				//^ nothing was read for a while, back to the initial size
+				if (m_size > m_min)
+					resize(m_min);
+			}
+
+		protected:
+			void resize(const std::size_t sz) noexcept
+			{
+				m_size = std::max(sz, m_min);
+				m_data.reset(); // allocated again by the next read
+				m_small_reads = 0;
+			}
+
+		protected:
+			static constexpr std::size_t initial_size = 4096;
+			static constexpr std::size_t shrink_after = 16;
+			static constexpr int		 idle_after_ms = 1000;
+
+			std::unique_ptr<char[]> m_data;
+			std::size_t				m_max;
+			std::size_t				m_min;
+			std::size_t				m_size;
+			std::size_t				m_small_reads = 0;
+		};
+
+		inline void set_pipe_capacity(const int fd, const std::size_t capacity) noexcept
+		{
+			//^ best effort, the kernel caps unprivileged processes at /proc/sys/fs/pipe-max-size
+#ifdef F_SETPIPE_SZ
+			if (fd != -1 && capacity != 0)
+				fcntl(fd, F_SETPIPE_SZ, int(std::min(capacity, std::size_t(INT_MAX))));
+#else
+			(void)fd;
+			(void)capacity;
+#endif
+		}
+
 		class posix_stream_handle : public pipe_handle
 		{
 		public:
-			inline posix_stream_handle(subprocess::stdfunc_t&& f) noexcept
+			inline posix_stream_handle(subprocess::stdfunc_t&& f, const subprocess::SinkRef& s) noexcept
 				: func(std::move(f))
+				, sink(s)
 			{
+				if (sink.func == nullptr && func != nullptr)
+					sink = subprocess::SinkRef::to(func); // the handle never moves, the reference stays valid
 			}
 
+			void deliver(const char* buffer, const std::size_t sz) noexcept
+			{
+				if (sink.func != nullptr)
+				{
+					metrics.delivered(sz);
+					stopwatch watch;
+					sink.func(sink.ctx, buffer, sz);
+					watch.record(metric_t::callback);
+				}
+			}
+
+			void frame_lines(const subprocess::CreateData& cd) noexcept
+			{
+				//^ deliver whole lines from now on
+				if (sink.func == nullptr)
+					return;
+				framer = std::make_unique<line_framer>(sink, cd);
+				sink = subprocess::SinkRef::to(*framer);
+			}
+
+			void close_stream() noexcept
+			{
+				//^ end of file, also ends the last line
+				close_read();
+				if (framer != nullptr)
+					framer->finish();
+			}
+
+			bool forward(char* buffer, const std::size_t max_buffer_size) noexcept
+			{
+				//^ read one chunk and pass it to func; returns false when the stream is exhausted
+				auto num = read_chunk(buffer, max_buffer_size);
+				if (num > 0)
+				{
+					deliver(buffer, std::size_t(num));
+					return true;
+				}
+				return num == -1 && (errno == EAGAIN || errno == EINTR);
+			}
+			bool forward(read_buffer& buffer) noexcept
+			{
+				auto num = read_chunk(buffer.data(), buffer.size());
+				if (num > 0)
+					deliver(buffer.data(), std::size_t(num));
+				else if (num == -1 && errno == EAGAIN)
+					buffer.idle(); // woken up for nothing
+				buffer.update(num);
+				return num > 0 || (num == -1 && (errno == EAGAIN || errno == EINTR));
+			}
+
+			void drain(char* buffer, const std::size_t max_buffer_size) noexcept
+			{
+				//^ forward whatever is already buffered in the pipe without blocking
+				//^ only called once the process is gone, so a partial last line is passed on as well
+				int pending = 0;
+				if (handles[0] != -1 && ioctl(handles[0], FIONREAD, &pending) != -1)
+				{
+					while (pending > 0)
+					{
+						auto num = read_chunk(buffer, std::min(max_buffer_size, std::size_t(pending)));
+						if (num <= 0)
+							break;
+						deliver(buffer, std::size_t(num));
+						pending -= int(num);
+					}
+				}
+
+				if (framer != nullptr)
+					framer->finish();
+			}
+
+			bool set_tee(const int fd, const bool owned) noexcept
+			{
+				//^ copy everything read from now on to fd as well; takes fd over if owned
+				tee_fd = fd;
+				tee_owned = owned;
+#ifdef __linux__
+				return tee_pipe.open_pipe();
+#else
+				return true;
+#endif
+			}
+			bool has_tee() const noexcept
+			{
+				return tee_fd != -1;
+			}
+			void close_tee() noexcept
+			{
+				tee_pipe.close_pipe();
+				if (tee_owned)
+					close(tee_fd);
+				tee_fd = -1;
+				tee_owned = false;
+			}
+
+		protected:
+			ssize_t read_chunk(char* buffer, const std::size_t max_buffer_size) noexcept
+			{
+				if (tee_fd == -1)
+					return ::read(handles[0], buffer, max_buffer_size);
+
+#ifdef __linux__
+				if (tee_pipe.handles[0] != -1)
+				{
+					// duplicate the pending bytes into tee_pipe without consuming them, then move that copy to tee_fd
+					auto teed = ::tee(handles[0], tee_pipe.handles[1], max_buffer_size, SPLICE_F_NONBLOCK);
+					if (teed == 0)
+						return 0;
+					if (teed > 0)
+					{
+						flush_tee_pipe(buffer, max_buffer_size, std::size_t(teed));
+						return ::read(handles[0], buffer, std::size_t(teed));
+					}
+					if (errno == EAGAIN || errno == EINTR)
+						return -1;
+					tee_pipe.close_pipe(); // not supported for this pipe, copy from userspace instead
+				}
+#endif
+				auto num = ::read(handles[0], buffer, max_buffer_size);
+				if (num > 0)
+					write_tee(buffer, std::size_t(num));
+				return num;
+			}
+
+#ifdef __linux__
+			void flush_tee_pipe(char* buffer, const std::size_t max_buffer_size, std::size_t remaining) noexcept
+			{
+				while (remaining > 0)
+				{
+					auto moved = ::splice(tee_pipe.handles[0], nullptr, tee_fd, nullptr, remaining, SPLICE_F_MOVE);
+					if (moved > 0)
+					{
+						remaining -= std::size_t(moved);
+						continue;
+					}
+					if (moved == -1 && errno == EINTR)
+						continue;
+
+					// the target does not take splices (an O_APPEND file on older kernels for example), copy it out
+					while (remaining > 0)
+					{
+						auto num = ::read(tee_pipe.handles[0], buffer, std::min(remaining, max_buffer_size));
+						if (num <= 0)
+							break;
+						write_tee(buffer, std::size_t(num));
+						remaining -= std::size_t(num);
+					}
+					tee_pipe.close_pipe();
+				}
+			}
+#endif
+
+			void write_tee(const char* buffer, std::size_t sz) noexcept
+			{
+				while (sz > 0)
+				{
+					auto num = ::write(tee_fd, buffer, sz);
+					if (num == -1 && errno == EINTR)
+						continue;
+					if (num <= 0)
+						return; // the tee is best effort, the callback still gets everything
+					buffer += num;
+					sz -= std::size_t(num);
+				}
+			}
+
+		public:
 			subprocess::stdfunc_t func;
+			subprocess::SinkRef	  sink;
+			//^ what output is delivered to, func unless the process was started with a sink
+			std::unique_ptr<line_framer> framer;
+			//^ set in line mode, sits between the reads and the original sink
+			std::size_t			  buffer_size = 0;
+			std::uint64_t		  reactor_token = 0;
+			stream_metrics		  metrics;
+
+		protected:
+			int			tee_fd = -1;
+			bool		tee_owned = false;
+			pipe_handle tee_pipe;
+		};
+
+		struct child_stdio
+		{
+			//^ descriptor handed to the child as stdin, stdout or stderr
+			int	 fd = -1;
+			bool owned = false;
+
+			inline ~child_stdio() noexcept
+			{
+				if (owned)
+					close(fd);
+			}
+
+			bool open(const subprocess::Redirect& r, pipe_handle& capture, const bool input) noexcept
+			{
+				switch (r.target)
+				{
+				case subprocess::Redirect::target_t::pipe:
+					if (capture.open_pipe() == false)
+						return false;
+					fd = capture.handles[input ? 0 : 1];
+					return true;
+				case subprocess::Redirect::target_t::null:
+					fd = ::open("/dev/null", (input ? O_RDONLY : O_WRONLY) | O_CLOEXEC);
+					break;
+				case subprocess::Redirect::target_t::file:
+					if (input)
+						fd = ::open(r.path.c_str(), O_RDONLY | O_CLOEXEC);
+					else
+						fd = ::open(r.path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (r.append ? O_APPEND : O_TRUNC), 0644);
+					break;
+				case subprocess::Redirect::target_t::descriptor:
+					if (r.fd > STDERR_FILENO)
+					{
+						fd = r.fd;
+						return true;
+					}
+					// the child's stdio is wired 0, 1, 2 in turn, a copy above them can't be overwritten before it is used
+					fd = r.fd >= 0 ? fcntl(r.fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1) : -1;
+					break;
+				}
+				owned = fd != -1;
+				return owned;
+			}
+
+			child_stdio() = default;
+			child_stdio(child_stdio&) = delete;
+			child_stdio& operator=(const child_stdio&) = delete;
+		};
+
+		inline int open_pidfd(const pid_t pid) noexcept
+		{
+			//^ descriptor that becomes readable when the process exits, -1 if the kernel has no pidfd support
+#ifdef SYS_pidfd_open
+			return int(syscall(SYS_pidfd_open, pid, 0));
+#else
+			(void)pid;
+			return -1;
+#endif
+		}
+
+		inline int exit_code(const int status) noexcept
+		{
+			int result = WEXITSTATUS(status);
+
+#ifdef SUBPROCESS_POSIX_SIGNALED_JOIN_ERROR
+			if (WIFSIGNALED(status) && result == 0)
+			{
+				if (status > 0)
+					result = -status;
+				else if (status < 0)
+					result = status;
+				else
+					result = -1;
+			}
+#endif
+			return result;
+		}
+
+		inline int wait_exit(const pid_t pid, struct rusage* usage = nullptr) noexcept
+		{
+			//^ blocks until the process exits and returns its exit code, -1 on failure; usage is filled by the same call that reaps it
+			int status = -1;
+			do
+			{
+				if (wait4(pid, &status, 0, usage) == -1)
+				{
+					if (errno == EINTR)
+						continue;
+					return -1;
+				}
+			} while (!WIFEXITED(status) && !WIFSIGNALED(status));
+
+			return exit_code(status);
+		}
+
+		inline int wait_exit(const pid_t pid, const std::uint64_t deadline, struct rusage* usage = nullptr) noexcept
+		{
+			//^ like wait_exit, but a pending deadline is cancelled after the exit and before the pid is released for reuse
+			if (deadline != 0)
+			{
+				siginfo_t info;
+				while (waitid(P_PID, id_t(pid), &info, WEXITED | WNOWAIT) == -1 && errno == EINTR)
+				{
+				}
+				deadline_timer::global().cancel(deadline);
+			}
+			return wait_exit(pid, usage);
+		}
+
+		inline bool reap_exited(const int pidfd) noexcept
+		{
+			//^ reaps a process its pidfd already reported as exited; doesn't block and, unlike wait4, can't reach a reused pid
+#ifdef SYS_pidfd_open
+			siginfo_t info;
+			int		  r;
+			while ((r = waitid(idtype_t(3) /* P_PIDFD, not named by older libcs */, id_t(pidfd), &info, WEXITED | WNOHANG)) == -1 && errno == EINTR)
+			{
+			}
+			return r == 0;
+#else
+			(void)pidfd;
+			return false;
+#endif
+		}
+
+		inline void set_usage(subprocess::JoinResult& result, const struct rusage& usage) noexcept
+		{
+			result.has_usage = true;
+			result.user_time = std::chrono::seconds(usage.ru_utime.tv_sec) + std::chrono::microseconds(usage.ru_utime.tv_usec);
+			result.system_time = std::chrono::seconds(usage.ru_stime.tv_sec) + std::chrono::microseconds(usage.ru_stime.tv_usec);
+#ifdef __APPLE__
+			result.max_rss = std::int64_t(usage.ru_maxrss);
+#else
+			result.max_rss = std::int64_t(usage.ru_maxrss) * 1024; // kilobytes everywhere else
+#endif
+			result.voluntary_switches = std::int64_t(usage.ru_nvcsw);
+			result.involuntary_switches = std::int64_t(usage.ru_nivcsw);
+		}
+
+		struct exit_state
+		{
+			void set(const int code, const struct rusage* ru = nullptr, const std::chrono::steady_clock::time_point when = std::chrono::steady_clock::now()) noexcept
+			{
+				//^ when is the moment the exit was observed, the end of JoinResult::wall_time
+				std::lock_guard<std::mutex> lock(mutex);
+				rc = code;
+				exited_at = when;
+				has_usage = ru != nullptr;
+				if (ru != nullptr)
+					usage = *ru;
+				exited = true;
+				cv.notify_all();
+			}
+			int wait() noexcept
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this]() { return exited; });
+				return rc;
+			}
+			bool done() noexcept
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				return exited;
+			}
+			bool wait_until(const std::chrono::steady_clock::time_point deadline) noexcept
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				return cv.wait_until(lock, deadline, [this]() { return exited; });
+			}
+			void get(subprocess::JoinResult& result, const std::chrono::steady_clock::time_point started) noexcept
+			{
+				//^ only valid once exited
+				std::lock_guard<std::mutex> lock(mutex);
+				result.rc = rc;
+				result.wall_time = exited_at - started;
+				if (has_usage)
+					set_usage(result, usage);
+			}
+
+			std::mutex				mutex;
+			std::condition_variable cv;
+			bool					exited = false;
+			int						rc = -1;
+
+			std::chrono::steady_clock::time_point exited_at;
+			bool								  has_usage = false;
+			struct rusage						  usage;
 		};
 
 	}
 
+}
+
+#include "subprocess-posix-reactor-impl.h"
+#include "subprocess-posix-uring-impl.h"
+#include "subprocess-posix-forkserver-impl.h"
+#include "subprocess-posix-spawn-impl.h"
+#include "subprocess-posix-path-impl.h"
+#include "subprocess-env-impl.h"
+#include "subprocess-posix-pipeline-impl.h"
+#include "subprocess-posix-stdin-impl.h"
+
+namespace splib
+{
+
 	class suprocess_impl
 	{
 	public:
-		inline suprocess_impl(subprocess::stdfunc_t&& stdout_func, subprocess::stdfunc_t&& stderr_func) noexcept
-			: stdout_handle(std::move(stdout_func))
-			, stderr_handle(std::move(stderr_func))
+		inline suprocess_impl(subprocess::stdfunc_t&& stdout_func, subprocess::stdfunc_t&& stderr_func, const subprocess::SinkRef& stdout_sink, const subprocess::SinkRef& stderr_sink) noexcept
+			: stdout_handle(std::move(stdout_func), stdout_sink)
+			, stderr_handle(std::move(stderr_func), stderr_sink)
 		{
 		}
 		inline ~suprocess_impl()
 		{
-			::write(m_close_pipe.handles[1], ".", 1);
+			if (deadline_id != 0)
+				detail::deadline_timer::global().cancel(deadline_id);
+
+			if (m_loop != nullptr)
+			{
+				// a writer still holding the pipe would otherwise add m_stdin_watch back after it is removed
+				if (stdin_channel != nullptr)
+					stdin_channel->set_wake(nullptr, false);
+				m_loop->remove_watch(m_exit_watch);
+				m_loop->remove_watch(m_stdin_watch);
+				m_loop->remove(stdout_handle);
+				m_loop->remove(stderr_handle);
+			}
+
+			m_stopping = true;
+			if (m_close_pipe.handles[1] != -1)
+				::write(m_close_pipe.handles[1], ".", 1);
 
 			if (m_buffer_thread.joinable())
 				m_buffer_thread.join();
 
+			if (stdin_channel != nullptr)
+				stdin_channel->detach();
+
 			stdout_handle.close_pipe();
 			stderr_handle.close_pipe();
+			stdout_handle.close_tee();
+			stderr_handle.close_tee();
 			m_close_pipe.close_pipe();
+
+			if (exit_state != nullptr && exit_state->done() == false && remote_exit != nullptr)
+			{
+				// killed before the exit was observed; the fork server reaps it, a thread waiting in join gets its status
+				exit_state->set(remote_exit->wait());
+			}
+			else if (exit_state != nullptr && exit_state->done() == false && pid > 0)
+			{
+				// killed before the exit was observed; reap it here so there is no zombie, and release a thread waiting in join
+				struct rusage usage;
+				usage.ru_maxrss = -1; // left untouched if nothing was reaped
+				int rc = detail::wait_exit(pid, &usage);
+				exit_state->set(rc, usage.ru_maxrss != -1 ? &usage : nullptr);
+			}
+
+			if (pidfd != -1)
+				close(pidfd);
 		}
 
-		void start(const std::size_t buffer_size) noexcept
+		void start(const std::size_t buffer_size, detail::reactor_loop* loop, const bool use_io_uring) noexcept
 		{
-			if (pipe(m_close_pipe.handles) != 0)
+			stdout_handle.buffer_size = buffer_size;
+			stderr_handle.buffer_size = buffer_size;
+
+			// everything is redirected and nobody waits for the exit, there is nothing to service
+			if (stdout_handle.handles[0] == -1 && stderr_handle.handles[0] == -1 && exit_state == nullptr)
+				return;
+
+			if (loop != nullptr && start_reactor(loop))
+				return;
+
+			if (m_close_pipe.open_pipe() == false)
 			{
 				return;
 			}
+			// wake ups must never block the writer, a full pipe already wakes the thread
+			fcntl(m_close_pipe.handles[1], F_SETFL, O_NONBLOCK);
+
+			if (stdin_channel != nullptr)
+			{
+				stdin_channel->set_wake(
+					[this]() {
+						::write(m_close_pipe.handles[1], "w", 1);
+					},
+					false);
+			}
 
 			SUBPROCESS_ASSERT(m_buffer_thread.joinable() == false);
-			m_buffer_thread = std::thread([this, buffer_size]() {
-				std::unique_ptr<char[]> buffer(new char[buffer_size]);
+			m_buffer_thread = std::thread([this, buffer_size, use_io_uring]() {
+				// stdin is written from here, a child that went away must not take the process down
+				sigset_t mask;
+				sigemptyset(&mask);
+				sigaddset(&mask, SIGPIPE);
+				pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+#ifdef SUBPROCESS_HAS_IO_URING
+				// teed streams need the tee(2) before each read, which the ring can't chain
+				if (use_io_uring && stdout_handle.has_tee() == false && stderr_handle.has_tee() == false && this->uring_buffering(buffer_size))
+					return;
+#else
+				(void)use_io_uring;
+#endif
+				detail::read_buffer buffer(buffer_size);
 
 				while (true)
 				{
-					bool ok = this->stream_buffering(buffer.get(), buffer_size);
+					bool ok = this->stream_buffering(buffer);
 					if (ok == false)
 						break;
 				}
 			});
 		}
 
-		bool stream_buffering(char* buffer, std::size_t max_buffer_size)
+		void stop_stdin_wake() noexcept
+		{
+			//^ the buffering thread is about to end, writers flush on their own from now on
+			if (stdin_channel != nullptr)
+				stdin_channel->set_wake(nullptr, false);
+		}
+
+		bool start_reactor(detail::reactor_loop* loop) noexcept
 		{
-			SUBPROCESS_ASSERT(buffer != nullptr && max_buffer_size > 0);
+			// without a pidfd the loop can't see the exit, a dedicated thread will wait for it instead
+			if (exit_state != nullptr && pidfd == -1)
+				return false;
 
+			auto add = [loop](detail::posix_stream_handle& stream) {
+				return stream.handles[0] == -1 || loop->add(stream);
+			};
+
+			if (add(stdout_handle) && add(stderr_handle))
+			{
+				if (stdin_channel != nullptr)
+				{
+					m_stdin_watch.fd = stdin_channel->handles[1];
+					m_stdin_watch.events = EPOLLOUT;
+					m_stdin_watch.func = [this]() {
+						stdin_channel->on_writable();
+					};
+					stdin_channel->set_wake(
+						[this, loop]() {
+							loop->add_watch(m_stdin_watch);
+						},
+						true);
+				}
+
+				if (exit_state == nullptr)
+				{
+					m_loop = loop;
+					return true;
+				}
+
+				m_exit_watch.fd = pidfd;
+				m_exit_watch.func = [this, loop]() {
+					loop->remove(stdout_handle);
+					loop->remove(stderr_handle);
+					this->reap();
+				};
+				if (loop->add_watch(m_exit_watch))
+				{
+					m_loop = loop;
+					return true;
+				}
+			}
+
+			loop->remove(stdout_handle);
+			loop->remove(stderr_handle);
+			if (stdin_channel != nullptr)
+				stdin_channel->set_wake(nullptr, false);
+			return false;
+		}
+
+		bool stream_buffering(detail::read_buffer& buffer)
+		{
 			auto hout = stdout_handle.handles[0];
 			auto herr = stderr_handle.handles[0];
 			auto hexit = m_close_pipe.handles[0];
+			auto hproc = exit_state != nullptr ? pidfd : -1;
+			auto hin = stdin_channel != nullptr && stdin_channel->watch_interest() ? stdin_channel->handles[1] : -1;
 
-			if (hout == -1 || herr == -1 || hexit == -1)
+			if (hexit == -1)
 				return false;
 
-			fd_set set;
-			FD_ZERO(&set);
-			FD_SET(hout, &set);
-			FD_SET(herr, &set);
-			FD_SET(hexit, &set);
+			if (hout == -1 && herr == -1)
+			{
+				if (exit_state == nullptr && hin == -1)
+				{
+					stop_stdin_wake();
+					return false;
+				}
+				if (exit_state != nullptr && hproc == -1)
+				{
+					stop_stdin_wake();
+					this->reap();
+					return false;
+				}
+			}
+
+			// poll has no FD_SETSIZE limit; entries left at -1 are skipped, revents of any kind count like select's readiness
+			enum
+			{
+				slot_exit,
+				slot_out,
+				slot_err,
+				slot_proc,
+				slot_in,
+				slot_count
+			};
+			pollfd fds[slot_count];
+			fds[slot_exit].fd = hexit;
+			fds[slot_out].fd = hout;
+			fds[slot_err].fd = herr;
+			fds[slot_proc].fd = hproc;
+			fds[slot_in].fd = hin;
+			for (auto& pfd : fds)
+			{
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+			}
+			fds[slot_in].events = POLLOUT;
+
+			auto ready = poll(fds, slot_count, buffer.idle_timeout());
+			if (ready == -1)
+				return errno == EINTR;
+			if (ready == 0)
+			{
+				buffer.idle();
+				return true;
+			}
+
+			if (fds[slot_exit].revents != 0)
+			{
+				char wake[64];
+				::read(hexit, wake, sizeof(wake));
+
+				if (m_stopping)
+				{
+					// the process is gone, pass on what it left behind
+					stdout_handle.drain(buffer.data(), buffer.size());
+					stderr_handle.drain(buffer.data(), buffer.size());
+					return false;
+				}
+				// otherwise stdin has new data, the next round watches it
+			}
 
-			auto hmax = std::max(hexit, std::max(hout, herr));
+			if (fds[slot_in].revents != 0)
+				stdin_channel->on_writable();
 
-			if (select(hmax + 1, &set, NULL, NULL, nullptr) == -1)
+			if (fds[slot_proc].revents != 0)
+			{
+				stdout_handle.drain(buffer.data(), buffer.size());
+				stderr_handle.drain(buffer.data(), buffer.size());
+				stop_stdin_wake();
+				this->reap();
 				return false;
+			}
 
-			bool data_read = false;
+			if (fds[slot_out].revents != 0)
+			{
+				if (stdout_handle.forward(buffer) == false)
+					stdout_handle.close_stream();
+			}
 
-			if (FD_ISSET(hexit, &set))
+			if (fds[slot_err].revents != 0)
+			{
+				if (stderr_handle.forward(buffer) == false)
+					stderr_handle.close_stream();
+			}
+
+			return true;
+		}
+
+#ifdef SUBPROCESS_HAS_IO_URING
+		bool uring_buffering(const std::size_t buffer_size)
+		{
+			//^ returns false if io_uring is not available and nothing was read
+			detail::read_buffer buffers[2] = { detail::read_buffer(buffer_size), detail::read_buffer(buffer_size) };
+			char				exit_byte = 0;
+
+			// declared last so in flight requests are cancelled before the buffers go away
+			detail::uring ring;
+			if (ring.open(16) == false)
 				return false;
 
-			if (FD_ISSET(hout, &set))
+			detail::posix_stream_handle* streams[2] = { &stdout_handle, &stderr_handle };
+			bool						 reading[2] = { false, false };
+			bool						 stopping = false;
+			bool						 closed = false;
+
+			auto queue_stream = [&](const std::size_t i) {
+				reading[i] = ring.queue_read(streams[i]->handles[0], buffers[i].data(), buffers[i].size(), i + 1);
+			};
+
+			for (std::size_t i = 0; i < 2; i++)
 			{
-				auto num = read(hout, buffer, max_buffer_size);
-				if (num <= 0)
-					return false;
-				if (stdout_handle.func != nullptr)
-					stdout_handle.func(buffer, std::size_t(num));
-				data_read = true;
+				if (streams[i]->handles[0] == -1)
+					continue; // redirected
+
+				// the ring waits on the pipe itself, a non blocking read would just bounce back with EAGAIN
+				fcntl(streams[i]->handles[0], F_SETFL, 0);
+				queue_stream(i);
 			}
+			ring.queue_read(m_close_pipe.handles[0], &exit_byte, 1, 3);
+
+			bool polling = exit_state != nullptr && pidfd != -1 && ring.queue_poll(pidfd, 4);
+			bool writing = false;
 
-			if (FD_ISSET(herr, &set))
+			while (true)
 			{
-				auto num = read(herr, buffer, max_buffer_size);
-				if (num <= 0)
-					return false;
-				if (stderr_handle.func != nullptr)
-					stderr_handle.func(buffer, std::size_t(num));
-				data_read = true;
+				if (writing == false && stopping == false && stdin_channel != nullptr && stdin_channel->watch_interest())
+					writing = ring.queue_poll(stdin_channel->handles[1], 5, POLLOUT);
+
+				if ((reading[0] || reading[1] || polling || writing) == false)
+					break;
+				if (ring.submit_and_wait() == false)
+					break;
+
+				ring.reap([&](const std::uint64_t id, const int res) {
+					if (id == 3 && res > 0 && m_stopping == false)
+					{
+						// stdin has new data, picked up at the top of the loop
+						ring.queue_read(m_close_pipe.handles[0], &exit_byte, 1, 3);
+						return;
+					}
+					if (id == 3 || (id == 4 && res > 0))
+					{
+						// closed from outside or the process exited, finish with a drain
+						stopping = true;
+						closed = closed || id == 3;
+						if (reading[0])
+							ring.queue_cancel(1);
+						if (reading[1])
+							ring.queue_cancel(2);
+						if (id == 3 && polling)
+							ring.queue_cancel(4);
+						if (writing)
+							ring.queue_cancel(5);
+					}
+					if (id == 4)
+						polling = false;
+					if (id == 5)
+					{
+						writing = false;
+						if (stopping == false && res > 0)
+							stdin_channel->on_writable();
+					}
+					if (id != 1 && id != 2)
+						return;
+
+					auto i = std::size_t(id - 1);
+					reading[i] = false;
+
+					if (res > 0)
+					{
+						streams[i]->deliver(buffers[i].data(), std::size_t(res));
+						buffers[i].update(res);
+					}
+					else if (res == 0 || (res != -EINTR && res != -EAGAIN && res != -ECANCELED))
+					{
+						streams[i]->close_stream();
+						return;
+					}
+
+					if (stopping == false)
+						queue_stream(i);
+				});
 			}
 
-			return data_read;
+			if (stopping)
+			{
+				// the process is gone, pass on what it left behind
+				stdout_handle.drain(buffers[0].data(), buffers[0].size());
+				stderr_handle.drain(buffers[0].data(), buffers[0].size());
+			}
+
+			stop_stdin_wake();
+			if (exit_state != nullptr && closed == false)
+				this->reap();
+
+			return true;
+		}
+#endif
+
+		int wait_child(struct rusage* usage) noexcept
+		{
+			//^ children of a fork server are reaped by the helper, which reports the status instead and leaves usage alone
+			return remote_exit != nullptr ? remote_exit->wait() : detail::wait_exit(pid, deadline_id, usage);
+		}
+
+		bool has_exited() noexcept
+		{
+			//^ false if it can't be told without reaping
+			auto state = exit_state != nullptr ? exit_state : remote_exit;
+			if (state != nullptr && state->done())
+				return true;
+			if (pidfd == -1)
+				return false;
+
+			pollfd pfd;
+			pfd.fd = pidfd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			return poll(&pfd, 1, 0) > 0;
+		}
+
+		void reap() noexcept
+		{
+			//^ called once output is drained; reaps the process in the background and reports the exit code
+			struct rusage usage;
+			int			  rc = wait_child(&usage);
+			auto		  exited_at = std::chrono::steady_clock::now(); // before the callback, it is not part of the wall time
+			if (exit_func != nullptr)
+				exit_func(rc);
+			exit_state->set(rc, remote_exit == nullptr ? &usage : nullptr, exited_at);
 		}
 
 	public:
@@ -143,79 +968,251 @@ namespace splib
 		detail::posix_stream_handle stderr_handle;
 
 		pid_t pid = 0;
+		int	  pidfd = -1;
+
+		std::chrono::steady_clock::time_point started;
+		//^ taken right before the spawn, the start of JoinResult::wall_time
+
+		std::chrono::milliseconds kill_timeout{ 16 };
+		std::uint64_t			  deadline_id = 0;
+		//^ entry in the deadline timer while CreateData::timeout is pending
+
+		subprocess::exitfunc_t				exit_func;
+		std::shared_ptr<detail::exit_state> exit_state;
+		//^ only set when the exit is watched in the background, join then waits on it instead of waitpid
+		std::shared_ptr<detail::exit_state> remote_exit;
+		//^ only set for processes started by a fork server
+
+		std::shared_ptr<pipe_impl> stdin_channel;
+		//^ shared with subprocess::m_stdin_pipe, flushed from the buffering thread or reactor
 
 	protected:
-		std::thread			m_buffer_thread;
-		detail::pipe_handle m_close_pipe;
+		std::thread			  m_buffer_thread;
+		detail::pipe_handle	  m_close_pipe;
+		detail::reactor_loop* m_loop = nullptr;
+		detail::fd_watch	  m_exit_watch;
+		detail::fd_watch	  m_stdin_watch;
+		std::atomic<bool>	  m_stopping{ false };
 	};
 
-	class pipe_impl : public detail::pipe_handle
+	namespace detail
 	{
-	public:
-		inline ~pipe_impl()
+		inline void send_signal(const suprocess_impl& p, const int sig) noexcept
 		{
-			close_pipe();
+			//^ prefers the pidfd, a plain pid may already belong to another process once reaped elsewhere
+#ifdef SYS_pidfd_send_signal
+			if (p.pidfd != -1 && syscall(SYS_pidfd_send_signal, p.pidfd, sig, nullptr, 0) == 0)
+				return;
+#endif
+			::kill(p.pid, sig);
 		}
-		inline bool write(const char* data, const std::size_t sz) noexcept
+
+		inline void arm_deadline(suprocess_impl& p, const std::chrono::milliseconds timeout) noexcept
 		{
-			SUBPROCESS_ASSERT(handles[1] != -1 && data != nullptr && sz > 0);
-			auto num = ::write(handles[1], data, sz);
-			return num > 0;
+			//^ once timeout has passed p is killed like subprocess::kill does: SIGTERM, then SIGKILL if still alive after kill_timeout
+			bool terminated = false;
+			p.deadline_id = deadline_timer::global().add(std::chrono::steady_clock::now() + timeout, [&p, terminated](std::chrono::steady_clock::time_point& next) mutable {
+				if (p.has_exited())
+					return false;
+
+				const int sig = terminated ? SIGKILL : SIGTERM;
+				::kill(-p.pid, sig);
+				send_signal(p, sig);
+				if (terminated)
+					return false;
+
+				terminated = true;
+				next = std::chrono::steady_clock::now() + p.kill_timeout;
+				return true;
+			});
 		}
-	};
+	}
 
-	bool subprocess::start(const CreateData& cd, stdfunc_t stdout_func, stdfunc_t stderr_func) noexcept
+	bool subprocess::start(const CreateData& cd, stdfunc_t stdout_func, stdfunc_t stderr_func, exitfunc_t exit_func) noexcept
 	{
+		PreparedCommand cmd;
+		cmd.pack(cd);
 
-		// run_cmd("ls");
+		return start_command(cd, cmd, std::move(stdout_func), std::move(stderr_func), std::move(exit_func), SinkRef(), SinkRef());
+	}
+
+	bool subprocess::start_sinks(const CreateData& cd, const SinkRef& stdout_sink, const SinkRef& stderr_sink, exitfunc_t&& exit_func) noexcept
+	{
+		PreparedCommand cmd;
+		cmd.pack(cd);
+
+		return start_command(cd, cmd, nullptr, nullptr, std::move(exit_func), stdout_sink, stderr_sink);
+	}
+
+	bool subprocess::start_command(const CreateData& cd, const PreparedCommand& cmd, stdfunc_t&& stdout_func, stdfunc_t&& stderr_func, exitfunc_t&& exit_func, const SinkRef& stdout_sink, const SinkRef& stderr_sink) noexcept
+	{
+		auto simpl = std::make_unique<suprocess_impl>(std::move(stdout_func), std::move(stderr_func), stdout_sink, stderr_sink);
+		auto pimpl = std::make_shared<pipe_impl>();
+
+		if (cd.line_mode)
+		{
+			simpl->stdout_handle.frame_lines(cd);
+			simpl->stderr_handle.frame_lines(cd);
+		}
 
-		auto simpl = std::make_unique<suprocess_impl>(std::move(stdout_func), std::move(stderr_func));
-		auto pimpl = std::make_unique<pipe_impl>();
+		simpl->exit_func = std::move(exit_func);
 
-		if (pipe(simpl->stdout_handle.handles) != 0)
+		detail::stopwatch	creating_pipes;
+		detail::child_stdio child_stdin;
+		detail::child_stdio child_stdout;
+		detail::child_stdio child_stderr;
+		if (child_stdout.open(cd.stdout_redirect, simpl->stdout_handle, false) == false)
+		{
+			return false;
+		}
+		if (cd.merge_stderr)
+		{
+			// both descriptors of the child are the same pipe, its writes arrive in the order they were made
+			child_stderr.fd = child_stdout.fd;
+		}
+		else if (child_stderr.open(cd.stderr_redirect, simpl->stderr_handle, false) == false)
 		{
 			return false;
 		}
-		if (pipe(simpl->stderr_handle.handles) != 0)
+		if (child_stdin.open(cd.stdin_redirect, *pimpl, true) == false)
 		{
 			return false;
 		}
-		if (pipe(pimpl->handles) != 0)
+
+		detail::set_pipe_capacity(simpl->stdout_handle.handles[0], cd.pipe_capacity);
+		detail::set_pipe_capacity(simpl->stderr_handle.handles[0], cd.pipe_capacity);
+		detail::set_pipe_capacity(pimpl->handles[1], cd.pipe_capacity);
+		creating_pipes.record(detail::metric_t::pipe_setup);
+
+		auto open_tee = [](const subprocess::Redirect& r, detail::posix_stream_handle& stream) {
+			if (r.target == Redirect::target_t::pipe || stream.handles[0] == -1)
+				return true;
+
+			detail::child_stdio target;
+			detail::pipe_handle unused;
+			if (target.open(r, unused, false) == false)
+				return false;
+
+			bool owned = target.owned;
+			target.owned = false;
+			return stream.set_tee(target.fd, owned);
+		};
+		if (open_tee(cd.stdout_tee, simpl->stdout_handle) == false || open_tee(cd.stderr_tee, simpl->stderr_handle) == false)
 		{
 			return false;
 		}
 
-		posix_spawn_file_actions_t action;
-		posix_spawn_file_actions_init(&action);
+		const bool	use_fork_server = cd.fork_server != nullptr && cd.fork_server->valid();
+		const char* exe = use_fork_server ? cd.exe.c_str() : cmd.exe();
 
-		posix_spawn_file_actions_adddup2(&action, pimpl->handles[0], STDIN_FILENO);
-		posix_spawn_file_actions_adddup2(&action, simpl->stdout_handle.handles[1], STDOUT_FILENO);
-		posix_spawn_file_actions_adddup2(&action, simpl->stderr_handle.handles[1], STDERR_FILENO);
+		char* const* envp = cd.env != nullptr ? cd.env->envp(environ) : environ;
 
-		std::vector<std::string> argbuffers;
-		std::vector<char*>		 argv;
+		std::string resolved;
+		if (cd.search_path && exe[0] != '\0' && std::strchr(exe, '/') == nullptr)
+		{
+			// searched in the environment the child gets, with an overlay that is the snapshot taken by envp
+			const char* path_env = detail::env_lookup(envp, "PATH");
+			if (detail::exe_cache::global().resolve(exe, path_env, resolved) == false)
+				return false;
+			exe = resolved.c_str();
+		}
 
-		for (const auto& a : cd.argv)
+		detail::stopwatch spawning;
+		simpl->started = std::chrono::steady_clock::now();
+		if (use_fork_server)
 		{
-			argbuffers.push_back(a);
+			int stdio[3] = { child_stdin.fd, child_stdout.fd, child_stderr.fd };
+
+			simpl->remote_exit = cd.fork_server->m_impl->spawn(cd, exe, cd.env != nullptr ? envp : nullptr, stdio, simpl->pid);
+			if (simpl->remote_exit == nullptr)
+			{
+				detail::count(detail::counter_t::spawn_failures);
+				return false;
+			}
 		}
-		for (auto& a : argbuffers)
+		else
 		{
-			argv.push_back(&a[0]);
+			char* const* argv = cmd.argv();
+
+			int spawn_error;
+			if (cd.spawn_strategy == spawn_strategy_t::posix_spawn)
+			{
+				posix_spawn_file_actions_t action;
+				posix_spawn_file_actions_init(&action);
+
+				posix_spawn_file_actions_adddup2(&action, child_stdin.fd, STDIN_FILENO);
+				posix_spawn_file_actions_adddup2(&action, child_stdout.fd, STDOUT_FILENO);
+				posix_spawn_file_actions_adddup2(&action, child_stderr.fd, STDERR_FILENO);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+				if (cd.cwd.size() > 0)
+					posix_spawn_file_actions_addchdir_np(&action, cd.cwd.c_str());
+#endif
+
+				spawn_error = posix_spawn(&(simpl->pid), exe, &action, nullptr, argv, envp);
+				posix_spawn_file_actions_destroy(&action);
+			}
+			else
+			{
+				detail::spawn_args args;
+				args.exe = exe;
+				args.argv = argv;
+				args.envp = envp;
+				args.cwd = cd.cwd.size() > 0 ? cd.cwd.c_str() : nullptr;
+				args.stdio[0] = child_stdin.fd;
+				args.stdio[1] = child_stdout.fd;
+				args.stdio[2] = child_stderr.fd;
+
+				spawn_error = detail::spawn_with(cd.spawn_strategy, args, simpl->pid);
+			}
+
+			if (spawn_error != 0)
+			{
+				detail::count(detail::counter_t::spawn_failures);
+				return false;
+			}
 		}
-		argv.push_back(nullptr);
+		spawning.record(detail::metric_t::spawn);
+		detail::count(detail::counter_t::spawns);
+
+		// only once there is a child, the destructor reaps pid for a pending exit state
+		if (simpl->exit_func != nullptr)
+			simpl->exit_state = std::make_shared<detail::exit_state>();
+		simpl->stdout_handle.metrics.arm(false, simpl->started);
+		simpl->stderr_handle.metrics.arm(true, simpl->started);
+
+		simpl->pidfd = detail::open_pidfd(simpl->pid);
+		simpl->kill_timeout = cd.kill_timeout;
+		if (cd.timeout.count() > 0)
+			detail::arm_deadline(*simpl, cd.timeout);
 
-		const char* exe = cd.exe.c_str();
+		// the child owns these ends now; dropping ours lets the readers see end of file
+		simpl->stdout_handle.close_write();
+		simpl->stderr_handle.close_write();
+		pimpl->close_read();
 
-		if (posix_spawn(&(simpl->pid), exe, &action, nullptr, argv.data(), nullptr) != 0)
+		if (simpl->stdout_handle.handles[0] != -1)
+			fcntl(simpl->stdout_handle.handles[0], F_SETFL, O_NONBLOCK);
+		if (simpl->stderr_handle.handles[0] != -1)
+			fcntl(simpl->stderr_handle.handles[0], F_SETFL, O_NONBLOCK);
+
+		detail::reactor_loop* loop = nullptr;
+		if (cd.reactor != nullptr && cd.reactor->valid())
+			loop = cd.reactor->m_impl->next_loop();
+
+		if (pimpl->handles[1] == -1)
 		{
-			return false;
+			pimpl.reset(); // stdin is redirected, stdin_write has nothing to write to
+		}
+		else
+		{
+			pimpl->open_channel(cd.stdin_high_water);
+			simpl->stdin_channel = pimpl;
 		}
 
-		simpl->start(cd.buffer_size);
+		simpl->start(cd.buffer_size, loop, cd.use_io_uring);
 
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 			SUBPROCESS_ASSERT(m_process_handle == nullptr);
 
 			m_process_handle.swap(simpl);
@@ -225,75 +1222,229 @@ namespace splib
 		return true;
 	}
 
-	int subprocess::join() noexcept
+	int subprocess::join(JoinResult& result) noexcept
 	{
-		pid_t pid;
+		pid_t								  pid;
+		std::uint64_t						  deadline;
+		std::chrono::steady_clock::time_point started;
+		std::shared_ptr<detail::exit_state>	  state;
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 			SUBPROCESS_ASSERT(m_process_handle != nullptr);
 			pid = m_process_handle->pid;
+			deadline = m_process_handle->deadline_id;
+			started = m_process_handle->started;
+			state = m_process_handle->exit_state;
+			if (state == nullptr)
+				state = m_process_handle->remote_exit;
 		}
 		SUBPROCESS_ASSERT(pid != 0);
 
-		int status = -1;
-		int result = -1;
-		do
+		result = JoinResult();
+		detail::stopwatch waiting;
+		if (state != nullptr)
 		{
-			if (waitpid(pid, &status, 0) == -1)
-			{
-				result = -1;
-				break;
-			}
+			state->wait();
+			state->get(result, started);
+		}
+		else
+		{
+			struct rusage usage;
+			usage.ru_maxrss = -1; // left untouched if nothing was reaped
+			result.rc = detail::wait_exit(pid, deadline, &usage);
+			result.wall_time = std::chrono::steady_clock::now() - started;
+			if (usage.ru_maxrss != -1)
+				detail::set_usage(result, usage);
+		}
+		waiting.record(detail::metric_t::join_wait);
+
+		std::unique_ptr<suprocess_impl> released;
+		{
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
+			released = this->release_no_lock();
+		}
 
-			result = WEXITSTATUS(status);
-		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
+		return result.rc;
+	}
 
-#ifdef SUBPROCESS_POSIX_SIGNALED_JOIN_ERROR
-		if (WIFSIGNALED(status) && result == 0)
+	bool subprocess::try_join(JoinResult& result) noexcept
+	{
+		std::unique_ptr<suprocess_impl>		   released; // declared first, destroyed once the lock is gone
+		std::lock_guard<detail::process_mutex> lock(m_process_mutex);
+		if (m_process_handle == nullptr)
+			return false;
+
+		auto state = m_process_handle->exit_state != nullptr ? m_process_handle->exit_state : m_process_handle->remote_exit;
+		if (state != nullptr)
 		{
-			if (status > 0)
-				result = -status;
-			else if (status < 0)
-				result = status;
-			else
-				result = -1;
+			if (state->done() == false)
+				return false;
+			result = JoinResult();
+			state->get(result, m_process_handle->started);
+			released = this->release_no_lock();
+			return true;
 		}
-#endif
 
+		if (m_process_handle->deadline_id != 0)
+		{
+			// the deadline must be gone before the pid can be reused
+			siginfo_t info;
+			info.si_pid = 0;
+			if (waitid(P_PID, id_t(m_process_handle->pid), &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0)
+				return false;
+			detail::deadline_timer::global().cancel(m_process_handle->deadline_id);
+		}
+
+		int			  status = -1;
+		struct rusage usage;
+		pid_t		  r = wait4(m_process_handle->pid, &status, WNOHANG, &usage);
+		if (r == 0)
+			return false;
+
+		result = JoinResult();
+		result.wall_time = std::chrono::steady_clock::now() - m_process_handle->started;
+		if (r != -1)
+			detail::set_usage(result, usage);
+		if (r == -1 || (!WIFEXITED(status) && !WIFSIGNALED(status)))
+			result.rc = -1;
+		else
+			result.rc = detail::exit_code(status);
+
+		released = this->release_no_lock();
+		return true;
+	}
+
+	bool subprocess::join_until(const std::chrono::steady_clock::time_point deadline, JoinResult& result) noexcept
+	{
+		std::shared_ptr<detail::exit_state> state;
+		int									pidfd = -1;
+		{
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
+			if (m_process_handle == nullptr)
+				return false;
+
+			state = m_process_handle->exit_state != nullptr ? m_process_handle->exit_state : m_process_handle->remote_exit;
+			// a private copy stays valid even if another thread joins meanwhile
+			if (state == nullptr && m_process_handle->pidfd != -1)
+				pidfd = fcntl(m_process_handle->pidfd, F_DUPFD_CLOEXEC, 0);
+		}
+
+		if (state != nullptr)
+		{
+			if (state->wait_until(deadline) == false)
+				return false;
+		}
+		else if (pidfd != -1)
+		{
+			pollfd pfd;
+			pfd.fd = pidfd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+
+			int r;
+			do
+			{
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+				r = poll(&pfd, 1, int(std::max(left.count() + 1, std::chrono::milliseconds::rep(0))));
+			} while ((r == -1 && errno == EINTR) || (r == 0 && std::chrono::steady_clock::now() < deadline));
+			close(pidfd);
+
+			if (r <= 0)
+				return false;
+		}
+		else
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
-			this->reset_no_lock();
+			// no way to wait for the exit with a timeout, poll it with a growing interval
+			auto interval = std::chrono::milliseconds(1);
+			while (try_join(result) == false)
+			{
+				auto now = std::chrono::steady_clock::now();
+				if (now >= deadline || joinable() == false)
+					return false;
+				std::this_thread::sleep_for(std::min(std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval), deadline - now));
+				interval = std::min(interval * 2, std::chrono::milliseconds(50));
+			}
+			return true;
 		}
 
-		return result;
+		return try_join(result);
+	}
+
+	int subprocess::exit_fd() noexcept
+	{
+		std::lock_guard<detail::process_mutex> lock(m_process_mutex);
+		if (m_process_handle == nullptr)
+			return -1;
+		return m_process_handle->pidfd;
 	}
 
 	void subprocess::kill() noexcept
 	{
+		int						  pidfd = -1;
+		std::chrono::milliseconds grace;
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 			if (m_process_handle == nullptr)
 				return;
 
 			auto id = m_process_handle->pid;
+			grace = m_process_handle->kill_timeout;
 
 			::kill(-id, SIGTERM);
-			::kill(id, SIGTERM);
+			detail::send_signal(*m_process_handle, SIGTERM);
+
+			// a private copy stays valid even if another thread joins meanwhile
+			if (m_process_handle->pidfd != -1)
+				pidfd = fcntl(m_process_handle->pidfd, F_DUPFD_CLOEXEC, 0);
 		}
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(16));
-		// give 16 ms time for the process to terminate, then kill
+		// give the process `grace` time to terminate, then kill
+		bool exited = false;
+		if (pidfd != -1)
+		{
+			pollfd pfd;
+			pfd.fd = pidfd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
 
+			int r;
+			do
+			{
+				r = poll(&pfd, 1, int(grace.count()));
+			} while (r == -1 && errno == EINTR);
+
+			exited = r > 0;
+			close(pidfd);
+		}
+		else
+		{
+			std::this_thread::sleep_for(grace);
+		}
+
+		std::unique_ptr<suprocess_impl> released;
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 			if (m_process_handle == nullptr)
 				return;
 
-			auto id = m_process_handle->pid;
-			::kill(-id, SIGKILL);
-			::kill(id, SIGKILL);
+			if (exited == false)
+			{
+				auto id = m_process_handle->pid;
+				::kill(-id, SIGKILL);
+				detail::send_signal(*m_process_handle, SIGKILL);
+			}
+			else if (m_process_handle->exit_state == nullptr && m_process_handle->remote_exit == nullptr)
+			{
+				// nothing else is going to reap it; the deadline must be gone before the pid can be reused
+				if (m_process_handle->deadline_id != 0)
+				{
+					detail::deadline_timer::global().cancel(m_process_handle->deadline_id);
+					m_process_handle->deadline_id = 0;
+				}
+				detail::reap_exited(m_process_handle->pidfd);
+			}
 
-			this->reset_no_lock();
+			released = this->release_no_lock();
 		}
 	}
 
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "subprocess.h"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace splib
+{
+
+	namespace detail
+	{
+		class exe_cache
+		{
+		public:
+			bool resolve(const char* name, const char* path_env, std::string& result) noexcept
+			{
+				//^ finds name in path_env; the answer is reused while path_env and the file it points to stay the same
+				if (path_env == nullptr)
+					path_env = "/bin:/usr/bin";
+
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_path_env != path_env)
+				{
+					m_path_env = path_env;
+					m_entries.clear();
+				}
+
+				auto itr = m_entries.find(name);
+				if (itr != m_entries.end())
+				{
+					entry current;
+					if (identify(itr->second.path, current) && current.same_file(itr->second))
+					{
+						result = itr->second.path;
+						return true;
+					}
+					m_entries.erase(itr);
+				}
+
+				entry found;
+				if (search(name, found) == false)
+					return false;
+
+				result = found.path;
+				m_entries.emplace(name, std::move(found));
+				return true;
+			}
+
+			static exe_cache& global() noexcept
+			{
+				static exe_cache cache;
+				return cache;
+			}
+
+		protected:
+			struct entry
+			{
+				std::string path;
+				dev_t		dev = 0;
+				ino_t		ino = 0;
+				timespec	mtime = {};
+				timespec	ctime = {};
+				//^ changes with chmod and chown too, which can take away the execute permission
+
+				bool same_file(const entry& other) const noexcept
+				{
+					return dev == other.dev && ino == other.ino && same_time(mtime, other.mtime) && same_time(ctime, other.ctime);
+				}
+				static bool same_time(const timespec& a, const timespec& b) noexcept
+				{
+					return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+				}
+			};
+
+			static bool identify(const std::string& path, entry& e) noexcept
+			{
+				struct stat st;
+				if (stat(path.c_str(), &st) == -1 || S_ISREG(st.st_mode) == false)
+					return false;
+
+				e.dev = st.st_dev;
+				e.ino = st.st_ino;
+				e.mtime = st.st_mtim;
+				e.ctime = st.st_ctim;
+				return true;
+			}
+
+			bool search(const char* name, entry& found) noexcept
+			{
+				const std::size_t name_size = std::strlen(name);
+
+				const char* dir = m_path_env.c_str();
+				while (true)
+				{
+					const char* end = std::strchr(dir, ':');
+					if (end == nullptr)
+						end = dir + std::strlen(dir);
+
+					// empty entries would mean the current directory, which is not necessarily the child's
+					if (end != dir)
+					{
+						found.path.assign(dir, end);
+						found.path.push_back('/');
+						found.path.append(name, name_size);
+
+						if (identify(found.path, found) && access(found.path.c_str(), X_OK) == 0)
+							return true;
+					}
+
+					if (*end == '\0')
+						return false;
+					dir = end + 1;
+				}
+			}
+
+		protected:
+			std::mutex							   m_mutex;
+			std::string							   m_path_env;
+			std::unordered_map<std::string, entry> m_entries;
+		};
+	}
+
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "subprocess.h"
+
+namespace splib
+{
+
+	class pipeline_impl
+	{
+	public:
+		bool start(const std::vector<subprocess::CreateData>& stages, subprocess::stdfunc_t&& stdout_func, subprocess::stdfunc_t&& stderr_func) noexcept
+		{
+			SUBPROCESS_ASSERT(joinable() == false);
+			if (stages.empty())
+				return false;
+
+			m_stderr_func = std::move(stderr_func);
+
+			subprocess::stdfunc_t on_stderr;
+			if (m_stderr_func != nullptr)
+			{
+				// every stage drains its stderr on its own thread
+				on_stderr = [this](const char* buffer, const std::size_t sz) {
+					std::lock_guard<std::mutex> lock(m_stderr_mutex);
+					m_stderr_func(buffer, sz);
+				};
+			}
+
+			m_stages = std::vector<subprocess>(stages.size());
+
+			detail::pipe_handle previous; // read end of the link feeding the next stage
+			for (std::size_t i = 0; i < stages.size(); i++)
+			{
+				const bool last = i + 1 == stages.size();
+
+				subprocess::CreateData cd = stages[i];
+				detail::pipe_handle	   link;
+
+				if (i > 0)
+					cd.stdin_redirect = subprocess::Redirect::to_fd(previous.handles[0]);
+				if (last == false)
+				{
+					if (link.open_pipe() == false)
+					{
+						previous.close_pipe();
+						kill();
+						return false;
+					}
+					cd.stdout_redirect = subprocess::Redirect::to_fd(link.handles[1]);
+				}
+
+				bool ok = m_stages[i].start(cd, last ? std::move(stdout_func) : nullptr, on_stderr);
+
+				// the children hold their own copies, ours would keep the next stage from seeing end of file
+				previous.close_pipe();
+				link.close_write();
+
+				if (ok == false)
+				{
+					link.close_read();
+					kill();
+					return false;
+				}
+
+				previous.handles[0] = link.handles[0];
+			}
+
+			return true;
+		}
+
+		bool joinable() noexcept
+		{
+			for (auto& s : m_stages)
+			{
+				if (s.joinable())
+					return true;
+			}
+			return false;
+		}
+
+		std::vector<int> join() noexcept
+		{
+			std::vector<int> result;
+			result.reserve(m_stages.size());
+			for (auto& s : m_stages)
+				result.push_back(s.joinable() ? s.join() : -1);
+			return result;
+		}
+
+		void stdin_close() noexcept
+		{
+			if (m_stages.empty() == false)
+				m_stages.front().stdin_close();
+		}
+		bool stdin_write(const char* bytes, const std::size_t n) noexcept
+		{
+			return m_stages.empty() == false && m_stages.front().stdin_write(bytes, n);
+		}
+
+		void kill() noexcept
+		{
+			for (auto& s : m_stages)
+				s.kill();
+		}
+
+	protected:
+		std::vector<subprocess> m_stages;
+
+		std::mutex			  m_stderr_mutex;
+		subprocess::stdfunc_t m_stderr_func;
+	};
+
+}
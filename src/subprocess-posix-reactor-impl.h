@@ -0,0 +1,280 @@
+#pragma once
+
+#include "subprocess.h"
+
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
+#include <signal.h>
+#include <sys/epoll.h>
+
+namespace splib
+{
+
+	namespace detail
+	{
+		struct fd_watch
+		{
+			int					  fd = -1;
+			std::uint32_t		  events = EPOLLIN;
+			std::function<void()> func;
+			//^ called from the loop once fd is ready for events, the watch is removed before that
+			std::uint64_t reactor_token = 0;
+		};
+
+		class reactor_loop
+		{
+		public:
+			inline reactor_loop(const std::size_t buffer_size) noexcept
+				: m_buffer_size(buffer_size)
+			{
+			}
+			inline ~reactor_loop()
+			{
+				if (m_thread.joinable())
+				{
+					m_stopping = true;
+					::write(m_wake_pipe.handles[1], ".", 1);
+					m_thread.join();
+				}
+
+				SUBPROCESS_ASSERT(m_streams.empty() && m_watches.empty());
+
+				m_wake_pipe.close_pipe();
+				if (m_epoll != -1)
+					close(m_epoll);
+			}
+
+			bool start() noexcept
+			{
+				m_epoll = epoll_create1(EPOLL_CLOEXEC);
+				if (m_epoll == -1)
+					return false;
+				if (m_wake_pipe.open_pipe() == false)
+					return false;
+
+				epoll_event ev;
+				ev.events = EPOLLIN;
+				ev.data.u64 = 0;
+				if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake_pipe.handles[0], &ev) == -1)
+					return false;
+
+				m_buffer.reset(new char[m_buffer_size]);
+				m_thread = std::thread([this]() {
+					this->run();
+				});
+				return true;
+			}
+
+			bool add(posix_stream_handle& stream) noexcept
+			{
+				SUBPROCESS_ASSERT(stream.reactor_token == 0 && stream.handles[0] != -1);
+
+				// only the registry is locked, adding is safe from inside callbacks of other loops
+				std::lock_guard<std::mutex> lock(m_registry_mutex);
+
+				auto token = m_next_token++;
+				if (watch(stream.handles[0], token) == false)
+					return false;
+
+				stream.reactor_token = token;
+				m_streams.emplace(token, &stream);
+				return true;
+			}
+
+			void remove(posix_stream_handle& stream) noexcept
+			{
+				//^ once this returns the loop no longer touches the stream; leftover output is forwarded from the calling thread
+				if (registered(stream.reactor_token) == false)
+					return;
+
+				std::lock_guard<std::recursive_mutex> dispatch_lock(m_dispatch_mutex);
+				std::lock_guard<std::mutex>			  lock(m_registry_mutex);
+				if (stream.reactor_token == 0)
+					return;
+
+				auto itr = m_streams.find(stream.reactor_token);
+				if (itr != m_streams.end())
+				{
+					epoll_ctl(m_epoll, EPOLL_CTL_DEL, stream.handles[0], nullptr);
+					m_streams.erase(itr);
+
+					stream.drain(m_buffer.get(), std::min(m_buffer_size, stream.buffer_size));
+				}
+				stream.reactor_token = 0;
+			}
+
+			bool add_watch(fd_watch& watch) noexcept
+			{
+				//^ one shot, safe to call again from inside func
+				SUBPROCESS_ASSERT(watch.reactor_token == 0 && watch.fd != -1);
+
+				std::lock_guard<std::mutex> lock(m_registry_mutex);
+
+				auto token = m_next_token++;
+				if (this->watch(watch.fd, token, watch.events) == false)
+					return false;
+
+				watch.reactor_token = token;
+				m_watches.emplace(token, &watch);
+				return true;
+			}
+
+			void remove_watch(fd_watch& watch) noexcept
+			{
+				// always waits for the dispatch, the watch is unregistered before its func runs
+				std::lock_guard<std::recursive_mutex> dispatch_lock(m_dispatch_mutex);
+				std::lock_guard<std::mutex>			  lock(m_registry_mutex);
+				if (watch.reactor_token == 0)
+					return;
+
+				auto itr = m_watches.find(watch.reactor_token);
+				if (itr != m_watches.end())
+				{
+					epoll_ctl(m_epoll, EPOLL_CTL_DEL, watch.fd, nullptr);
+					m_watches.erase(itr);
+				}
+				watch.reactor_token = 0;
+			}
+
+		protected:
+			bool watch(const int fd, const std::uint64_t token, const std::uint32_t events = EPOLLIN) noexcept
+			{
+				epoll_event ev;
+				ev.events = events;
+				ev.data.u64 = token;
+				return epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) == 0;
+			}
+
+			bool registered(const std::uint64_t& token) noexcept
+			{
+				// tokens are only cleared with the registry locked
+				std::lock_guard<std::mutex> lock(m_registry_mutex);
+				return token != 0;
+			}
+
+			void run() noexcept
+			{
+				sigset_t mask;
+				sigemptyset(&mask);
+				sigaddset(&mask, SIGPIPE);
+				pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+				constexpr int max_events = 64;
+				epoll_event	  events[max_events];
+
+				while (m_stopping == false)
+				{
+					int n = epoll_wait(m_epoll, events, max_events, -1);
+					if (n == -1)
+					{
+						if (errno == EINTR)
+							continue;
+						break;
+					}
+
+					// held while callbacks run so remove() can wait for them to finish
+					std::lock_guard<std::recursive_mutex> dispatch_lock(m_dispatch_mutex);
+					for (int i = 0; i < n; i++)
+					{
+						auto token = events[i].data.u64;
+						if (token == 0)
+							continue; // woken up to stop
+
+						posix_stream_handle* stream = nullptr;
+						fd_watch*			 watch = nullptr;
+						{
+							std::lock_guard<std::mutex> lock(m_registry_mutex);
+
+							auto itr = m_streams.find(token);
+							if (itr != m_streams.end())
+							{
+								stream = itr->second;
+							}
+							else
+							{
+								auto witr = m_watches.find(token);
+								if (witr == m_watches.end())
+									continue; // removed while waiting
+
+								watch = witr->second;
+								epoll_ctl(m_epoll, EPOLL_CTL_DEL, watch->fd, nullptr);
+								watch->reactor_token = 0;
+								m_watches.erase(witr);
+							}
+						}
+
+						if (watch != nullptr)
+						{
+							watch->func();
+							continue;
+						}
+
+						if (stream->forward(m_buffer.get(), std::min(m_buffer_size, stream->buffer_size)) == false)
+						{
+							std::lock_guard<std::mutex> lock(m_registry_mutex);
+
+							epoll_ctl(m_epoll, EPOLL_CTL_DEL, stream->handles[0], nullptr);
+							stream->close_stream();
+							m_streams.erase(stream->reactor_token);
+							stream->reactor_token = 0;
+						}
+					}
+				}
+			}
+
+		protected:
+			int				  m_epoll = -1;
+			pipe_handle		  m_wake_pipe;
+			std::thread		  m_thread;
+			std::atomic<bool> m_stopping{ false };
+
+			std::recursive_mutex m_dispatch_mutex;
+			std::mutex			 m_registry_mutex;
+
+			std::unordered_map<std::uint64_t, posix_stream_handle*> m_streams;
+			std::unordered_map<std::uint64_t, fd_watch*>			m_watches;
+			std::uint64_t											m_next_token = 1;
+
+			std::unique_ptr<char[]> m_buffer;
+			const std::size_t		m_buffer_size;
+		};
+	}
+
+	class reactor_impl
+	{
+	public:
+		inline reactor_impl(const std::size_t thread_count, const std::size_t buffer_size) noexcept
+		{
+			SUBPROCESS_ASSERT(thread_count > 0 && buffer_size > 0);
+
+			for (std::size_t i = 0; i < thread_count; i++)
+			{
+				auto loop = std::make_unique<detail::reactor_loop>(buffer_size);
+				if (loop->start() == false)
+				{
+					m_loops.clear();
+					return;
+				}
+				m_loops.push_back(std::move(loop));
+			}
+		}
+
+		bool valid() const noexcept
+		{
+			return m_loops.empty() == false;
+		}
+
+		detail::reactor_loop* next_loop() noexcept
+		{
+			//^ processes are spread round robin, both streams of a process share a loop
+			return m_loops[m_next++ % m_loops.size()].get();
+		}
+
+	protected:
+		std::vector<std::unique_ptr<detail::reactor_loop>> m_loops;
+		std::atomic<std::size_t>						   m_next{ 0 };
+	};
+
+}
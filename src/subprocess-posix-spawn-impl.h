@@ -0,0 +1,109 @@
+#pragma once
+
+#include "subprocess.h"
+
+#include <signal.h>
+#include <sched.h>
+
+extern char** environ;
+
+namespace splib
+{
+
+	namespace detail
+	{
+		struct spawn_args
+		{
+			const char*	  exe = nullptr;
+			char* const*  argv = nullptr;
+			char* const*  envp = nullptr;
+			const char*	  cwd = nullptr;
+			int			  stdio[3] = { -1, -1, -1 };
+			sigset_t	  mask;
+			volatile int  error = 0;
+			//^ written by the child, which shares the parent's memory until exec
+		};
+
+		inline int spawn_child(void* p) noexcept
+		{
+			//^ runs in the child before exec; only async signal safe calls, no allocation
+			spawn_args& args = *static_cast<spawn_args*>(p);
+
+			// handlers belong to the parent, whose memory is still shared
+			for (int sig = 1; sig < NSIG; sig++)
+			{
+				struct sigaction sa;
+				if (sigaction(sig, nullptr, &sa) == 0 && sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL)
+				{
+					sa.sa_handler = SIG_DFL;
+					sa.sa_flags = 0;
+					sigaction(sig, &sa, nullptr);
+				}
+			}
+			sigprocmask(SIG_SETMASK, &args.mask, nullptr);
+
+			int e = 0;
+			for (int i = 0; i < 3 && e == 0; i++)
+			{
+				if (args.stdio[i] == i)
+				{
+					if (fcntl(i, F_SETFD, 0) == -1)
+						e = errno;
+				}
+				else if (dup2(args.stdio[i], i) == -1)
+				{
+					e = errno;
+				}
+			}
+
+			if (e == 0 && args.cwd != nullptr && chdir(args.cwd) == -1)
+				e = errno;
+
+			if (e == 0)
+			{
+				execve(args.exe, args.argv, args.envp != nullptr ? args.envp : environ);
+				e = errno;
+			}
+
+			args.error = e;
+			_exit(127);
+		}
+
+		inline int spawn_with(const subprocess::spawn_strategy_t strategy, spawn_args& args, pid_t& pid) noexcept
+		{
+			//^ vfork/clone based spawn, returns 0 or an errno value like posix_spawn
+			sigset_t all;
+			sigfillset(&all);
+			pthread_sigmask(SIG_SETMASK, &all, &args.mask);
+
+			if (strategy == subprocess::spawn_strategy_t::vfork)
+			{
+				pid = vfork();
+				if (pid == 0)
+					spawn_child(&args);
+			}
+			else
+			{
+				// the parent is suspended until exec, so the child can borrow a piece of our stack
+				alignas(16) char stack[16384];
+				pid = clone(spawn_child, stack + sizeof(stack), CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+			}
+
+			int e = pid == -1 ? errno : 0;
+
+			pthread_sigmask(SIG_SETMASK, &args.mask, nullptr);
+
+			if (e != 0)
+				return e;
+
+			if (args.error != 0)
+			{
+				// never got to exec
+				waitpid(pid, nullptr, 0);
+				return args.error;
+			}
+			return 0;
+		}
+	}
+
+}
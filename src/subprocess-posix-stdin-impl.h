@@ -0,0 +1,513 @@
+#pragma once
+
+#include "subprocess.h"
+#include "subprocess-metrics-impl.h"
+
+#include <deque>
+
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+namespace splib
+{
+
+	class pipe_impl : public detail::pipe_handle
+	{
+		//^ write end of the child's stdin with a queue of pending buffers
+		//^ queued data is flushed with non blocking writev, either by the writer or by the process' background machinery
+	protected:
+		struct chunk
+		{
+			std::string					 storage;
+			//^ owned copy for queued writes, empty for blocking writes which point into the caller's buffer
+			const char*					 data = nullptr;
+			std::size_t					 size = 0;
+			std::size_t					 written = 0;
+			subprocess::stdin_donefunc_t done;
+
+			int	  source = -1;
+			//^ fed descriptors: the data is moved from source with splice instead of being read from memory
+			off_t offset = 0;
+			//^ read position in source, negative to use and advance its own file position
+			bool copy = false;
+			//^ source can't be spliced, it is staged through storage a block at a time
+			std::size_t bounce = 0;
+			//^ bytes of storage already written while copying
+			bool gift = false;
+			//^ storage is handed to the pipe with vmsplice and retired instead of freed once written
+			bool* status = nullptr;
+			//^ set to true by the writer when the chunk is written completely, for blocking callers
+		};
+
+		static constexpr std::size_t gift_min_size = 65536;
+		//^ smaller buffers are cheaper to copy than to pin
+		static constexpr std::size_t bounce_size = 65536;
+
+		using completions_t = std::vector<std::pair<subprocess::stdin_donefunc_t, bool>>;
+
+	public:
+		inline ~pipe_impl()
+		{
+			detach();
+		}
+
+		void open_channel(const std::size_t high_water) noexcept
+		{
+			//^ called once the child owns the read end
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_high_water = high_water;
+			if (handles[1] != -1)
+				fcntl(handles[1], F_SETFL, O_NONBLOCK);
+		}
+
+		bool write(const char* data, const std::size_t sz) noexcept
+		{
+			//^ blocks until everything is written or the pipe breaks; the process lock is not held meanwhile
+			SUBPROCESS_ASSERT(data != nullptr && sz > 0);
+
+			completions_t				 completions;
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (accepting_no_lock() == false)
+				return false;
+
+			chunk c;
+			c.data = data;
+			c.size = sz;
+			auto id = push_no_lock(std::move(c), completions);
+
+			auto done = [this, id]() { return m_completed >= id || m_failed; };
+			if (done() == false)
+			{
+				// the pipe is full, the rest has to wait for the child
+				detail::stopwatch stalled;
+				wait_no_lock(lock, completions, done);
+				stalled.record(detail::metric_t::stdin_stall);
+			}
+			bool ok = m_completed >= id;
+
+			lock.unlock();
+			run(completions);
+			return ok;
+		}
+
+		bool feed_fd(const int fd, const std::int64_t offset, std::size_t len) noexcept
+		{
+			//^ blocks until len bytes of fd are in the pipe, fd has to stay open until then
+			if (len == std::size_t(-1))
+			{
+				// up to the end of the file, which only regular files have
+				struct stat st;
+				if (fstat(fd, &st) == -1 || S_ISREG(st.st_mode) == false)
+					return false;
+				std::int64_t start = offset < 0 ? std::int64_t(lseek(fd, 0, SEEK_CUR)) : offset;
+				if (start < 0)
+					return false;
+				len = start < std::int64_t(st.st_size) ? std::size_t(st.st_size - start) : 0;
+			}
+
+			completions_t				 completions;
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (accepting_no_lock() == false)
+				return false;
+			if (len == 0)
+				return true;
+
+			bool  ok = false;
+			chunk c;
+			c.source = fd;
+			c.offset = off_t(offset);
+			c.size = len;
+			c.status = &ok;
+			auto id = push_no_lock(std::move(c), completions);
+
+			wait_no_lock(lock, completions, [this, id]() { return m_completed >= id || m_failed; });
+
+			lock.unlock();
+			run(completions);
+			return ok;
+		}
+
+		bool write_async(std::string&& data, subprocess::stdin_donefunc_t&& done, const bool gift = false) noexcept
+		{
+			completions_t				 completions;
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (accepting_no_lock() == false)
+				return false;
+
+			chunk c;
+			c.storage = std::move(data);
+			c.size = c.storage.size();
+			c.done = std::move(done);
+#ifdef __linux__
+			c.gift = gift && c.size >= gift_min_size;
+#else
+			(void)gift;
+#endif
+			auto id = push_no_lock(std::move(c), completions);
+
+			// nothing in the background will flush it, so this one can't return early
+			if (m_wake == nullptr)
+				wait_no_lock(lock, completions, [this, id]() { return m_completed >= id || m_failed; });
+
+			lock.unlock();
+			run(completions);
+			return true;
+		}
+
+		std::size_t pending() noexcept
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_pending;
+		}
+
+		bool wait_writable(const std::chrono::milliseconds timeout) noexcept
+		{
+			//^ true once fewer than high water bytes are pending, false on timeout or if stdin no longer takes data
+			completions_t				 completions;
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			auto deadline = std::chrono::steady_clock::now() + timeout;
+			wait_no_lock(
+				lock, completions, [this]() { return m_pending < m_high_water || accepting_no_lock() == false; }, &deadline);
+			bool ok = m_pending < m_high_water && accepting_no_lock();
+
+			lock.unlock();
+			run(completions);
+			return ok;
+		}
+
+		bool flush() noexcept
+		{
+			//^ waits until the queue is empty, false if some of it could not be written
+			completions_t				 completions;
+			std::unique_lock<std::mutex> lock(m_mutex);
+			wait_no_lock(lock, completions, [this]() { return m_queue.empty() && m_completing == 0; });
+			bool ok = m_failed == false;
+
+			lock.unlock();
+			run(completions);
+			return ok;
+		}
+
+		void close() noexcept
+		{
+			//^ no more writes; the pipe is closed once the queue is flushed
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closing = true;
+			if (m_queue.empty())
+				close_write();
+			m_cv.notify_all();
+		}
+
+		void set_wake(std::function<void()> wake, const bool rearm) noexcept
+		{
+			//^ wake asks the background machinery to watch for writability; with rearm it is asked again after each on_writable that leaves data behind
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_wake = std::move(wake);
+			m_rearm = rearm;
+			m_armed = false;
+			m_cv.notify_all(); // waiters without machinery flush themselves
+		}
+
+		bool watch_interest() noexcept
+		{
+			//^ for loops that rebuild their wait set every iteration, true if the fd should be watched for writability
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_armed = m_queue.empty() == false && handles[1] != -1;
+			return m_armed;
+		}
+
+		void on_writable() noexcept
+		{
+			completions_t completions;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_armed = false;
+				flush_no_lock(completions);
+				if (m_rearm)
+					wake_no_lock();
+			}
+			run(completions);
+		}
+
+		void detach() noexcept
+		{
+			//^ the process is gone, fail whatever is left and wake every waiter
+			completions_t completions;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_wake = nullptr;
+				fail_no_lock(completions);
+				close_pipe();
+				m_retired.clear();
+			}
+			run(completions);
+		}
+
+	protected:
+		bool accepting_no_lock() const noexcept
+		{
+			return handles[1] != -1 && m_closing == false && m_failed == false;
+		}
+
+		std::uint64_t push_no_lock(chunk&& c, completions_t& completions) noexcept
+		{
+			m_queue.push_back(std::move(c));
+			if (m_queue.back().storage.empty() == false)
+				m_queue.back().data = m_queue.back().storage.data();
+			m_pending += m_queue.back().size;
+
+			auto id = ++m_pushed;
+			flush_no_lock(completions);
+			wake_no_lock();
+			return id;
+		}
+
+		void wake_no_lock() noexcept
+		{
+			if (m_wake != nullptr && m_armed == false && m_queue.empty() == false && handles[1] != -1)
+			{
+				m_armed = true;
+				m_wake();
+			}
+		}
+
+		template <class P>
+		bool wait_no_lock(std::unique_lock<std::mutex>& lock, completions_t& completions, const P& pred, const std::chrono::steady_clock::time_point* deadline = nullptr) noexcept
+		{
+			while (pred() == false)
+			{
+				if (deadline != nullptr && std::chrono::steady_clock::now() >= *deadline)
+					return false;
+
+				if (m_wake != nullptr || m_queue.empty())
+				{
+					if (deadline != nullptr)
+						m_cv.wait_until(lock, *deadline);
+					else
+						m_cv.wait(lock);
+					continue;
+				}
+
+				// no background machinery, poll and flush from this thread
+				pollfd pfd;
+				pfd.fd = handles[1];
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+				if (pfd.fd == -1)
+					return pred();
+
+				lock.unlock();
+				poll(&pfd, 1, 100);
+				lock.lock();
+				flush_no_lock(completions);
+			}
+			return true;
+		}
+
+		void flush_no_lock(completions_t& completions) noexcept
+		{
+			constexpr std::size_t max_iov = IOV_MAX < 64 ? IOV_MAX : 64;
+
+			bool changed = false;
+			while (m_queue.empty() == false && handles[1] != -1)
+			{
+				chunk&	front = m_queue.front();
+				ssize_t num = 0;
+				if (front.source != -1)
+				{
+					num = feed_no_lock(front);
+					if (num == 0)
+					{
+						// the source ended or broke early, only this chunk fails
+						finish_no_lock(false, completions);
+						changed = true;
+						continue;
+					}
+				}
+#ifdef __linux__
+				else if (front.gift)
+				{
+					iovec iov;
+					iov.iov_base = const_cast<char*>(front.data + front.written);
+					iov.iov_len = front.size - front.written;
+					num = ::vmsplice(handles[1], &iov, 1, SPLICE_F_NONBLOCK);
+					if (num == -1 && (errno == EINVAL || errno == ENOSYS))
+					{
+						front.gift = false; // copy it with writev instead
+						continue;
+					}
+				}
+#endif
+				else
+				{
+					// plain memory chunks are batched, fed and gifted ones are left for their own call
+					iovec		iov[max_iov];
+					std::size_t count = 0;
+					for (auto itr = m_queue.begin(); itr != m_queue.end() && count < max_iov && itr->source == -1 && itr->gift == false; ++itr, count++)
+					{
+						iov[count].iov_base = const_cast<char*>(itr->data + itr->written);
+						iov[count].iov_len = itr->size - itr->written;
+					}
+					num = ::writev(handles[1], iov, int(count));
+				}
+
+				if (num == -1)
+				{
+					if (errno == EINTR)
+						continue;
+					if (errno != EAGAIN)
+						fail_no_lock(completions); // the child closed its stdin
+					break;
+				}
+
+				changed = true;
+				m_pending -= std::size_t(num);
+				detail::count(detail::counter_t::stdin_bytes, std::size_t(num));
+				while (num > 0)
+				{
+					chunk& c = m_queue.front();
+					auto   n = std::min(std::size_t(num), c.size - c.written);
+					c.written += n;
+					num -= ssize_t(n);
+
+					if (c.written == c.size)
+						finish_no_lock(true, completions);
+				}
+			}
+
+			if (m_queue.empty() && m_closing)
+				close_write();
+			if (m_retired.empty() == false && handles[1] != -1)
+			{
+				// an empty pipe no longer references any gifted page
+				int unread = 0;
+				if (ioctl(handles[1], FIONREAD, &unread) == 0 && unread == 0)
+					m_retired.clear();
+			}
+			if (changed)
+				m_cv.notify_all();
+		}
+
+		void finish_no_lock(const bool ok, completions_t& completions) noexcept
+		{
+			chunk& front = m_queue.front();
+			if (front.status != nullptr)
+				*front.status = ok;
+			if (front.done != nullptr)
+			{
+				completions.emplace_back(std::move(front.done), ok);
+				m_completing++;
+			}
+			if (front.gift)
+				m_retired.push_back(std::move(front.storage)); // long strings keep their buffer when moved
+			m_pending -= front.size - front.written;
+			m_queue.pop_front();
+			m_completed++;
+		}
+
+		ssize_t feed_no_lock(chunk& c) noexcept
+		{
+			//^ bytes moved from c.source into the pipe, 0 if the source ended or failed, -1 with errno for the pipe
+			const std::size_t remaining = c.size - c.written;
+#ifdef __linux__
+			if (c.copy == false)
+			{
+				loff_t	off = c.offset;
+				ssize_t num = ::splice(c.source, c.offset < 0 ? nullptr : &off, handles[1], nullptr, remaining, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (num > 0)
+				{
+					if (c.offset >= 0)
+						c.offset = off_t(off);
+					return num;
+				}
+				if (num == 0 || errno == EAGAIN || errno == EINTR || errno == EPIPE)
+					return num;
+				if (errno != EINVAL && errno != ENOSYS)
+					return 0;
+				c.copy = true; // the file system does not splice
+			}
+#endif
+			if (c.bounce == c.storage.size())
+			{
+				c.storage.resize(std::min(remaining, bounce_size));
+				ssize_t num;
+				do
+				{
+					num = c.offset < 0 ? ::read(c.source, &c.storage[0], c.storage.size()) : ::pread(c.source, &c.storage[0], c.storage.size(), c.offset);
+				} while (num == -1 && errno == EINTR);
+
+				c.bounce = 0;
+				if (num <= 0)
+				{
+					c.storage.clear();
+					return 0;
+				}
+				c.storage.resize(std::size_t(num));
+				if (c.offset >= 0)
+					c.offset += num;
+			}
+
+			auto num = ::write(handles[1], c.storage.data() + c.bounce, c.storage.size() - c.bounce);
+			if (num > 0)
+				c.bounce += std::size_t(num);
+			return num;
+		}
+
+		void fail_no_lock(completions_t& completions) noexcept
+		{
+			for (auto& c : m_queue)
+			{
+				if (c.done != nullptr)
+				{
+					completions.emplace_back(std::move(c.done), false);
+					m_completing++;
+				}
+			}
+			m_queue.clear();
+			m_pending = 0;
+			m_failed = true;
+			close_write();
+			m_cv.notify_all();
+		}
+
+		void run(completions_t& completions) noexcept
+		{
+			//^ done functions run without the lock so they may queue more data
+			if (completions.empty())
+				return;
+
+			for (auto& c : completions)
+				c.first(c.second);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_completing -= completions.size();
+			completions.clear();
+			m_cv.notify_all();
+		}
+
+	protected:
+		std::mutex				m_mutex;
+		std::condition_variable m_cv;
+
+		std::deque<chunk> m_queue;
+		std::size_t		  m_pending = 0;
+		std::uint64_t	  m_pushed = 0;
+		std::uint64_t	  m_completed = 0;
+		//^ chunks that left the queue in order, written or cut short by their source
+		std::size_t		  m_completing = 0;
+		//^ done functions collected but not yet called
+		std::size_t		  m_high_water = std::size_t(-1);
+		bool			  m_closing = false;
+		bool			  m_failed = false;
+
+		std::vector<std::string> m_retired;
+		//^ gifted buffers that may still be referenced by the pipe
+
+		std::function<void()> m_wake;
+		bool				  m_rearm = false;
+		bool				  m_armed = false;
+	};
+
+}
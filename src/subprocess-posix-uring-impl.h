@@ -0,0 +1,195 @@
+#pragma once
+
+#include "subprocess.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#	define SUBPROCESS_HAS_IO_URING
+#endif
+
+#ifdef SUBPROCESS_HAS_IO_URING
+
+#	include <cstring>
+
+#	include <poll.h>
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#	include <linux/io_uring.h>
+
+namespace splib
+{
+
+	namespace detail
+	{
+		class uring
+		{
+		public:
+			uring() = default;
+			uring(uring&) = delete;
+			uring& operator=(const uring&) = delete;
+
+			inline ~uring() noexcept
+			{
+				//^ closing the ring cancels whatever is still queued
+				if (m_sqes != nullptr)
+					munmap(m_sqes, m_sqes_size);
+				if (m_cq_ptr != nullptr && m_cq_ptr != m_sq_ptr)
+					munmap(m_cq_ptr, m_cq_size);
+				if (m_sq_ptr != nullptr)
+					munmap(m_sq_ptr, m_sq_size);
+				if (m_fd != -1)
+					close(m_fd);
+			}
+
+			bool open(const unsigned entries) noexcept
+			{
+				io_uring_params params;
+				std::memset(&params, 0, sizeof(params));
+
+				m_fd = int(syscall(__NR_io_uring_setup, entries, &params));
+				if (m_fd == -1)
+					return false;
+
+				m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+				m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+				if (params.features & IORING_FEAT_SINGLE_MMAP)
+					m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+
+				m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+				if (m_sq_ptr == MAP_FAILED)
+				{
+					m_sq_ptr = nullptr;
+					return false;
+				}
+
+				if (params.features & IORING_FEAT_SINGLE_MMAP)
+				{
+					m_cq_ptr = m_sq_ptr;
+				}
+				else
+				{
+					m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+					if (m_cq_ptr == MAP_FAILED)
+					{
+						m_cq_ptr = nullptr;
+						return false;
+					}
+				}
+
+				m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+				void* sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+				if (sqes == MAP_FAILED)
+					return false;
+				m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+				auto sq = static_cast<char*>(m_sq_ptr);
+				m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+				m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+				m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+				m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+				auto cq = static_cast<char*>(m_cq_ptr);
+				m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+				m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+				m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+				m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+				m_entries = params.sq_entries;
+				return true;
+			}
+
+			bool queue(const std::uint8_t opcode, const int fd, void* buffer, const std::size_t sz, const std::uint64_t user_data, const unsigned poll_events = 0) noexcept
+			{
+				unsigned tail = *m_sq_tail;
+				if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_entries)
+					return false;
+
+				unsigned index = tail & m_sq_mask;
+
+				io_uring_sqe& sqe = m_sqes[index];
+				std::memset(&sqe, 0, sizeof(sqe));
+				sqe.opcode = opcode;
+				sqe.fd = fd;
+				sqe.addr = reinterpret_cast<std::uint64_t>(buffer);
+				sqe.len = unsigned(sz);
+				sqe.off = opcode == IORING_OP_READ ? std::uint64_t(-1) : 0; // reads use the current file position, required for pipes; polls reject anything but 0
+				sqe.user_data = user_data;
+				sqe.poll32_events = poll_events; // shares storage with rw_flags, zero for everything but polls
+
+				m_sq_array[index] = index;
+				__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+				m_to_submit++;
+				return true;
+			}
+
+			bool queue_read(const int fd, char* buffer, const std::size_t sz, const std::uint64_t user_data) noexcept
+			{
+				return queue(IORING_OP_READ, fd, buffer, sz, user_data);
+			}
+			bool queue_poll(const int fd, const std::uint64_t user_data, const unsigned events = POLLIN) noexcept
+			{
+				return queue(IORING_OP_POLL_ADD, fd, nullptr, 0, user_data, events);
+			}
+			bool queue_cancel(const std::uint64_t target) noexcept
+			{
+				return queue(IORING_OP_ASYNC_CANCEL, -1, reinterpret_cast<void*>(target), 0, 0);
+			}
+
+			bool submit_and_wait() noexcept
+			{
+				//^ submit queued requests and wait for at least one completion
+				while (true)
+				{
+					auto r = syscall(__NR_io_uring_enter, m_fd, m_to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+					if (r >= 0)
+					{
+						m_to_submit -= unsigned(r);
+						return true;
+					}
+					if (errno != EINTR)
+						return false;
+				}
+			}
+
+			template <class F>
+			void reap(const F& _func)
+			{
+				unsigned head = *m_cq_head;
+				while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+				{
+					const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+					_func(cqe.user_data, cqe.res);
+					head++;
+				}
+				__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+			}
+
+		protected:
+			int m_fd = -1;
+
+			void*		  m_sq_ptr = nullptr;
+			std::size_t	  m_sq_size = 0;
+			void*		  m_cq_ptr = nullptr;
+			std::size_t	  m_cq_size = 0;
+			io_uring_sqe* m_sqes = nullptr;
+			std::size_t	  m_sqes_size = 0;
+
+			unsigned* m_sq_head = nullptr;
+			unsigned* m_sq_tail = nullptr;
+			unsigned* m_sq_array = nullptr;
+			unsigned  m_sq_mask = 0;
+
+			unsigned*	  m_cq_head = nullptr;
+			unsigned*	  m_cq_tail = nullptr;
+			unsigned	  m_cq_mask = 0;
+			io_uring_cqe* m_cqes = nullptr;
+
+			unsigned m_entries = 0;
+			unsigned m_to_submit = 0;
+		};
+
+	}
+
+}
+
+#endif
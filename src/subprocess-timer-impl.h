@@ -0,0 +1,115 @@
+#pragma once
+
+#include "subprocess.h"
+
+#include <condition_variable>
+#include <map>
+#include <thread>
+
+namespace splib
+{
+
+	namespace detail
+	{
+		class deadline_timer
+		{
+			//^ a single thread serving every process deadline, it sleeps until the earliest one is due
+		public:
+			using clock_t = std::chrono::steady_clock;
+			using func_t = std::function<bool(clock_t::time_point& next)>;
+			//^ return true to run again at next
+
+			inline ~deadline_timer() noexcept
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_stopping = true;
+				}
+				m_cv.notify_one();
+				if (m_thread.joinable())
+					m_thread.join();
+			}
+
+			std::uint64_t add(const clock_t::time_point when, func_t&& func) noexcept
+			{
+				//^ returns an id for cancel, never 0
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_thread.joinable() == false)
+					m_thread = std::thread([this]() { this->run(); });
+
+				auto id = ++m_next_id;
+				m_due.emplace(std::make_pair(when, id), std::move(func));
+				m_when.emplace(id, when);
+				m_cv.notify_one();
+				return id;
+			}
+
+			void cancel(const std::uint64_t id) noexcept
+			{
+				//^ once this returns the function is neither running nor going to run
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto itr = m_when.find(id);
+				if (itr == m_when.end())
+					return;
+				m_due.erase(std::make_pair(itr->second, id));
+				m_when.erase(itr);
+			}
+
+			static deadline_timer& global() noexcept
+			{
+				static deadline_timer timer;
+				return timer;
+			}
+
+		protected:
+			void run() noexcept
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				while (m_stopping == false)
+				{
+					if (m_due.empty())
+					{
+						m_cv.wait(lock);
+						continue;
+					}
+
+					auto first = m_due.begin();
+					if (clock_t::now() < first->first.first)
+					{
+						// copied, cancel may erase the entry while we sleep
+						const auto when = first->first.first;
+						m_cv.wait_until(lock, when);
+						continue;
+					}
+
+					// runs under the lock so cancel can wait for it; functions must be short and not call back into the timer
+					auto id = first->first.second;
+					auto func = std::move(first->second);
+					m_due.erase(first);
+
+					clock_t::time_point next;
+					if (func(next))
+					{
+						m_due.emplace(std::make_pair(next, id), std::move(func));
+						m_when[id] = next;
+					}
+					else
+					{
+						m_when.erase(id);
+					}
+				}
+			}
+
+		protected:
+			std::mutex				m_mutex;
+			std::condition_variable m_cv;
+			std::thread				m_thread;
+			bool					m_stopping = false;
+
+			std::map<std::pair<clock_t::time_point, std::uint64_t>, func_t> m_due;
+			std::map<std::uint64_t, clock_t::time_point>					 m_when;
+			std::uint64_t													 m_next_id = 0;
+		};
+	}
+
+}
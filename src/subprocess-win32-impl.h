@@ -1,11 +1,17 @@
 #pragma once
 
 #include "subprocess.h"
+#include "subprocess-line-impl.h"
+#include "subprocess-timer-impl.h"
+#include "subprocess-metrics-impl.h"
 
 #include <windows.h>
 #include <cstring>
 #include <TlHelp32.h>
+#include <psapi.h>
 #include <stdexcept>
+#include <atomic>
+#include <thread>
 
 namespace splib
 {
@@ -30,9 +36,20 @@ namespace splib
 		class win32_stream_handle : public safe_handle
 		{
 		public:
-			inline win32_stream_handle(subprocess::stdfunc_t&& f) noexcept
+			inline win32_stream_handle(subprocess::stdfunc_t&& f, const subprocess::SinkRef& s) noexcept
 				: m_func(std::move(f))
+				, m_sink(s)
 			{
+				if (m_sink.func == nullptr && m_func != nullptr)
+					m_sink = subprocess::SinkRef::to(m_func);
+			}
+
+			void frame_lines(const subprocess::CreateData& cd) noexcept
+			{
+				if (m_sink.func == nullptr)
+					return;
+				m_framer = std::make_unique<line_framer>(m_sink, cd);
+				m_sink = subprocess::SinkRef::to(*m_framer);
 			}
 
 			inline ~win32_stream_handle() noexcept
@@ -41,10 +58,11 @@ namespace splib
 					m_buffer_thread.join();
 			}
 
-			void start(const std::size_t buffer_size) noexcept
+			template <class F>
+			void start(const std::size_t buffer_size, const F& on_done) noexcept
 			{
 				SUBPROCESS_ASSERT(m_buffer_thread.joinable() == false);
-				m_buffer_thread = std::thread([this, buffer_size]() {
+				m_buffer_thread = std::thread([this, buffer_size, on_done]() {
 					std::unique_ptr<char[]> buffer(new char[buffer_size]);
 					DWORD					sz = 0;
 					while (true)
@@ -54,15 +72,28 @@ namespace splib
 							break;
 						if (sz == 0)
 							break;
-						if (m_func != nullptr)
-							m_func(buffer.get(), sz);
+						if (m_sink.func != nullptr)
+						{
+							metrics.delivered(sz);
+							stopwatch watch;
+							m_sink.func(m_sink.ctx, buffer.get(), sz);
+							watch.record(metric_t::callback);
+						}
 					}
+					if (m_framer != nullptr)
+						m_framer->finish();
+					on_done();
 				});
 			}
 
+		public:
+			stream_metrics metrics;
+
 		protected:
 			subprocess::stdfunc_t m_func;
-			std::thread			  m_buffer_thread;
+			subprocess::SinkRef			 m_sink;
+			std::unique_ptr<line_framer> m_framer;
+			std::thread					 m_buffer_thread;
 		};
 
 	}
@@ -70,12 +101,43 @@ namespace splib
 	class suprocess_impl
 	{
 	public:
-		inline suprocess_impl(subprocess::stdfunc_t&& stdout_func, subprocess::stdfunc_t&& stderr_func) noexcept
-			: stdout_handle(std::move(stdout_func))
-			, stderr_handle(std::move(stderr_func))
+		inline suprocess_impl(subprocess::stdfunc_t&& stdout_func, subprocess::stdfunc_t&& stderr_func, const subprocess::SinkRef& stdout_sink, const subprocess::SinkRef& stderr_sink) noexcept
+			: stdout_handle(std::move(stdout_func), stdout_sink)
+			, stderr_handle(std::move(stderr_func), stderr_sink)
+		{
+		}
+		inline ~suprocess_impl()
+		{
+			if (deadline_id != 0)
+				detail::deadline_timer::global().cancel(deadline_id);
+		}
+
+		void start(const std::size_t buffer_size) noexcept
 		{
+			auto on_done = [this]() {
+				// the last stream to finish reports the exit
+				if (--open_streams != 0 || exit_func == nullptr)
+					return;
+
+				int rc = -1;
+
+				DWORD code;
+				WaitForSingleObject(process_handle.handle, INFINITE);
+				if (GetExitCodeProcess(process_handle.handle, &code) == TRUE)
+					rc = static_cast<int>(code);
+
+				exit_func(rc);
+			};
+
+			stdout_handle.start(buffer_size, on_done);
+			stderr_handle.start(buffer_size, on_done);
 		}
 
+		subprocess::exitfunc_t exit_func;
+		std::uint64_t		   deadline_id = 0;
+		std::atomic<int>	   open_streams{ 2 };
+		//^ declared before the stream handles so both outlive the buffering threads
+
 		detail::safe_handle			process_handle;
 		detail::win32_stream_handle stdout_handle;
 		detail::win32_stream_handle stderr_handle;
@@ -83,25 +145,143 @@ namespace splib
 		DWORD pid = 0;
 	};
 
+	class reactor_impl
+	{
+	public:
+		inline reactor_impl(const std::size_t, const std::size_t) noexcept
+		{
+		}
+
+		bool valid() const noexcept
+		{
+			return false;
+		}
+	};
+
+	class fork_server_impl
+	{
+	public:
+		bool start(const subprocess_fork_server::entryfunc_t&) noexcept
+		{
+			return false;
+		}
+		void stop() noexcept
+		{
+		}
+		bool valid() const noexcept
+		{
+			return false;
+		}
+	};
+
+	class pipeline_impl
+	{
+	public:
+		bool start(const std::vector<subprocess::CreateData>&, subprocess::stdfunc_t&&, subprocess::stdfunc_t&&) noexcept
+		{
+			return false;
+		}
+		bool joinable() noexcept
+		{
+			return false;
+		}
+		std::vector<int> join() noexcept
+		{
+			return {};
+		}
+		void stdin_close() noexcept
+		{
+		}
+		bool stdin_write(const char*, const std::size_t) noexcept
+		{
+			return false;
+		}
+		void kill() noexcept
+		{
+		}
+	};
+
 	class pipe_impl : public detail::safe_handle
 	{
+		//^ anonymous pipes have no overlapped mode, queued writes are written right away
 	public:
 		inline bool write(const char* data, const std::size_t sz) noexcept
 		{
-			SUBPROCESS_ASSERT(handle != INVALID_HANDLE_VALUE && data != nullptr && sz > 0);
+			SUBPROCESS_ASSERT(data != nullptr && sz > 0);
 
-			DWORD outsz;
-			BOOL  ok = WriteFile(handle, data, static_cast<DWORD>(sz), &outsz, nullptr);
-			if (ok && outsz > 0)
-				return true;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::size_t					written = 0;
+			while (handle != INVALID_HANDLE_VALUE && written < sz)
+			{
+				DWORD outsz = 0;
+				BOOL  ok = WriteFile(handle, data + written, static_cast<DWORD>(sz - written), &outsz, nullptr);
+				if (ok == FALSE)
+					return false;
+				written += outsz;
+				detail::count(detail::counter_t::stdin_bytes, outsz);
+			}
+			return written == sz;
+		}
+		inline bool feed_fd(const int, const std::int64_t, const std::size_t) noexcept
+		{
+			return false;
+		}
+		inline bool write_async(std::string&& data, subprocess::stdin_donefunc_t&& done, const bool = false) noexcept
+		{
+			if (handle == INVALID_HANDLE_VALUE)
+				return false;
+			bool ok = write(data.data(), data.size());
+			if (done != nullptr)
+				done(ok);
 			return true;
 		}
+		inline std::size_t pending() noexcept
+		{
+			return 0;
+		}
+		inline bool wait_writable(const std::chrono::milliseconds) noexcept
+		{
+			return handle != INVALID_HANDLE_VALUE;
+		}
+		inline bool flush() noexcept
+		{
+			return true;
+		}
+		inline void close() noexcept
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (handle != INVALID_HANDLE_VALUE)
+				CloseHandle(handle);
+			handle = INVALID_HANDLE_VALUE;
+		}
+
+	protected:
+		std::mutex m_mutex;
 	};
 
-	bool subprocess::start(const CreateData& cd, stdfunc_t stdout_func, stdfunc_t stderr_func) noexcept
+	bool subprocess::start(const CreateData& cd, stdfunc_t stdout_func, stdfunc_t stderr_func, exitfunc_t exit_func) noexcept
+	{
+		// CreateProcess takes a single command line, there is nothing to pack
+		return start_command(cd, PreparedCommand(), std::move(stdout_func), std::move(stderr_func), std::move(exit_func), SinkRef(), SinkRef());
+	}
+
+	bool subprocess::start_sinks(const CreateData& cd, const SinkRef& stdout_sink, const SinkRef& stderr_sink, exitfunc_t&& exit_func) noexcept
+	{
+		return start_command(cd, PreparedCommand(), nullptr, nullptr, std::move(exit_func), stdout_sink, stderr_sink);
+	}
+
+	bool subprocess::start_command(const CreateData& cd, const PreparedCommand&, stdfunc_t&& stdout_func, stdfunc_t&& stderr_func, exitfunc_t&& exit_func, const SinkRef& stdout_sink, const SinkRef& stderr_sink) noexcept
 	{
-		auto simpl = std::make_unique<suprocess_impl>(std::move(stdout_func), std::move(stderr_func));
-		auto pimpl = std::make_unique<pipe_impl>();
+		auto simpl = std::make_unique<suprocess_impl>(std::move(stdout_func), std::move(stderr_func), stdout_sink, stderr_sink);
+		auto pimpl = std::make_shared<pipe_impl>();
+
+		if (cd.line_mode)
+		{
+			simpl->stdout_handle.frame_lines(cd);
+			simpl->stderr_handle.frame_lines(cd);
+		}
+
+		simpl->exit_func = std::move(exit_func);
 
 		SECURITY_ATTRIBUTES security_attributes;
 
@@ -109,6 +289,7 @@ namespace splib
 		security_attributes.bInheritHandle = TRUE;
 		security_attributes.lpSecurityDescriptor = nullptr;
 
+		detail::stopwatch	creating_pipes;
 		detail::safe_handle stdout_write;
 		detail::safe_handle stderr_write;
 		detail::safe_handle stdin_read;
@@ -127,6 +308,7 @@ namespace splib
 				return false;
 		}
 
+		if (cd.merge_stderr == false)
 		{
 			if (CreatePipe(&(simpl->stderr_handle.handle), &stderr_write.handle, &security_attributes, 0) == false)
 				return false;
@@ -134,6 +316,8 @@ namespace splib
 				return false;
 		}
 
+		creating_pipes.record(detail::metric_t::pipe_setup);
+
 		PROCESS_INFORMATION process_info;
 		STARTUPINFO			startup_info;
 
@@ -143,7 +327,7 @@ namespace splib
 		startup_info.cb = sizeof(STARTUPINFO);
 		startup_info.hStdInput = stdin_read.handle;
 		startup_info.hStdOutput = stdout_write.handle;
-		startup_info.hStdError = stderr_write.handle;
+		startup_info.hStdError = cd.merge_stderr ? stdout_write.handle : stderr_write.handle;
 
 		startup_info.dwFlags |= STARTF_USESTDHANDLES;
 
@@ -165,25 +349,43 @@ namespace splib
 
 		SUBPROCESS_ASSERT(command_tmp.size() <= MAX_PATH);
 
+		detail::stopwatch spawning;
+
 		BOOL ok = CreateProcess(nullptr, raw_cmd, nullptr, nullptr, TRUE, 0,
 			nullptr, // env
 			raw_cwd, // cwd
 			&startup_info, &process_info);
 
 		if (ok == FALSE)
+		{
+			detail::count(detail::counter_t::spawn_failures);
 			return false;
+		}
+		spawning.record(detail::metric_t::spawn);
+		detail::count(detail::counter_t::spawns);
+		simpl->stdout_handle.metrics.arm(false, spawning.started());
+		simpl->stderr_handle.metrics.arm(true, spawning.started());
 
 		CloseHandle(process_info.hThread);
 
 		simpl->process_handle.handle = process_info.hProcess;
 		simpl->pid = process_info.dwProcessId;
 
+		if (cd.timeout.count() > 0)
+		{
+			// no signals to escalate through, the process is terminated right away
+			HANDLE h = simpl->process_handle.handle;
+			simpl->deadline_id = detail::deadline_timer::global().add(std::chrono::steady_clock::now() + cd.timeout, [h](std::chrono::steady_clock::time_point&) {
+				TerminateProcess(h, 2);
+				return false;
+			});
+		}
+
 		// start buffering threads:
-		simpl->stdout_handle.start(cd.buffer_size);
-		simpl->stderr_handle.start(cd.buffer_size);
+		simpl->start(cd.buffer_size);
 
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 			SUBPROCESS_ASSERT(m_process_handle == nullptr);
 
 			m_process_handle.swap(simpl);
@@ -193,33 +395,103 @@ namespace splib
 		return true;
 	}
 
-	int subprocess::join() noexcept
+	namespace detail
+	{
+		inline void get_usage(HANDLE h, subprocess::JoinResult& result) noexcept
+		{
+			//^ windows keeps no context switch counts per process, those stay 0
+			auto ticks = [](const FILETIME& ft) {
+				return std::chrono::nanoseconds((std::int64_t(ft.dwHighDateTime) << 32 | ft.dwLowDateTime) * 100);
+			};
+
+			FILETIME created, exited, kernel, user;
+			if (GetProcessTimes(h, &created, &exited, &kernel, &user) == TRUE)
+			{
+				result.has_usage = true;
+				result.wall_time = ticks(exited) - ticks(created);
+				result.user_time = std::chrono::duration_cast<std::chrono::microseconds>(ticks(user));
+				result.system_time = std::chrono::duration_cast<std::chrono::microseconds>(ticks(kernel));
+			}
+
+			PROCESS_MEMORY_COUNTERS counters;
+			if (K32GetProcessMemoryInfo(h, &counters, sizeof(counters)) == TRUE)
+				result.max_rss = std::int64_t(counters.PeakWorkingSetSize);
+		}
+	}
+
+	int subprocess::join(JoinResult& result) noexcept
 	{
 		HANDLE h;
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 			SUBPROCESS_ASSERT(m_process_handle != nullptr);
 			h = m_process_handle->process_handle.handle;
 		}
 		SUBPROCESS_ASSERT(h != INVALID_HANDLE_VALUE);
 
-		int result = -1;
+		result = JoinResult();
 
 		{
+			detail::stopwatch waiting;
 			WaitForSingleObject(h, INFINITE);
+			waiting.record(detail::metric_t::join_wait);
 
 			DWORD rc;
 			BOOL  ok = GetExitCodeProcess(h, &rc);
 			if (ok == TRUE)
-				result = static_cast<int>(rc);
+				result.rc = static_cast<int>(rc);
+			detail::get_usage(h, result);
 		}
 
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 			this->reset_no_lock();
 		}
 
-		return result;
+		return result.rc;
+	}
+
+	bool subprocess::try_join(JoinResult& result) noexcept
+	{
+		std::lock_guard<detail::process_mutex> lock(m_process_mutex);
+		if (m_process_handle == nullptr)
+			return false;
+
+		HANDLE h = m_process_handle->process_handle.handle;
+		if (WaitForSingleObject(h, 0) == WAIT_TIMEOUT)
+			return false;
+
+		result = JoinResult();
+
+		DWORD code;
+		if (GetExitCodeProcess(h, &code) == TRUE)
+			result.rc = static_cast<int>(code);
+		detail::get_usage(h, result);
+
+		this->reset_no_lock();
+		return true;
+	}
+
+	bool subprocess::join_until(const std::chrono::steady_clock::time_point deadline, JoinResult& result) noexcept
+	{
+		HANDLE h;
+		{
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
+			if (m_process_handle == nullptr)
+				return false;
+			h = m_process_handle->process_handle.handle;
+		}
+
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if (WaitForSingleObject(h, static_cast<DWORD>((std::max)(left.count(), std::chrono::milliseconds::rep(0)))) == WAIT_TIMEOUT)
+			return false;
+
+		return try_join(result);
+	}
+
+	int subprocess::exit_fd() noexcept
+	{
+		return -1;
 	}
 
 	template <class F>
@@ -257,7 +529,7 @@ namespace splib
 
 	void subprocess::kill() noexcept
 	{
-		std::lock_guard<std::mutex> lock(m_process_mutex);
+		std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 		if (m_process_handle == nullptr)
 			return;
 
@@ -1,6 +1,8 @@
 
 #include "../include/subprocess.h"
 
+#include <cstring>
+
 
 #ifdef SUBPROCESS_ENABLE_ASSERT_IMPL
 #	include <iostream>
@@ -15,7 +17,11 @@
 #	include "subprocess-posix-impl.h"
 #endif
 
+#include "subprocess-env-impl.h"
+#include "subprocess-metrics-impl.h"
+#include "subprocess-capture-impl.h"
 #include "subprocess-common-impl.h"
+#include "subprocess-pool-impl.h"
 
 namespace splib
 {
@@ -28,6 +34,34 @@ namespace splib
 	}
 #endif
 
+#ifdef SUBPROCESS_ENABLE_METRICS
+	subprocess_metrics subprocess_metrics::snapshot() noexcept
+	{
+		auto&			   registry = detail::metrics_registry::global();
+		subprocess_metrics result;
+
+		registry.read(detail::metric_t::pipe_setup, result.pipe_setup);
+		registry.read(detail::metric_t::spawn, result.spawn);
+		registry.read(detail::metric_t::first_byte, result.first_byte);
+		registry.read(detail::metric_t::callback, result.callback);
+		registry.read(detail::metric_t::stdin_stall, result.stdin_stall);
+		registry.read(detail::metric_t::join_wait, result.join_wait);
+
+		result.spawns = registry.read(detail::counter_t::spawns);
+		result.spawn_failures = registry.read(detail::counter_t::spawn_failures);
+		result.stdout_bytes = registry.read(detail::counter_t::stdout_bytes);
+		result.stderr_bytes = registry.read(detail::counter_t::stderr_bytes);
+		result.stdout_callbacks = registry.read(detail::counter_t::stdout_callbacks);
+		result.stderr_callbacks = registry.read(detail::counter_t::stderr_callbacks);
+		result.stdin_bytes = registry.read(detail::counter_t::stdin_bytes);
+		return result;
+	}
+	void subprocess_metrics::reset() noexcept
+	{
+		detail::metrics_registry::global().reset();
+	}
+#endif
+
 	bool subprocess::CreateData::make_cmd(const std::string_view& cmdline)
 	{
 		exe.clear();
@@ -98,6 +132,96 @@ namespace splib
 		return true;
 	}
 
+	subprocess::Redirect subprocess::Redirect::to_null() noexcept
+	{
+		Redirect r;
+		r.target = target_t::null;
+		return r;
+	}
+
+	subprocess::Redirect subprocess::Redirect::to_file(const std::string& path, const bool append)
+	{
+		Redirect r;
+		r.target = target_t::file;
+		r.path = path;
+		r.append = append;
+		return r;
+	}
+
+	subprocess::Redirect subprocess::Redirect::to_fd(const int fd) noexcept
+	{
+		Redirect r;
+		r.target = target_t::descriptor;
+		r.fd = fd;
+		return r;
+	}
+
+	bool subprocess::CreateData::env_set(const std::string_view& name, const std::string_view& value)
+	{
+		if (name.empty() || name.find('=') != std::string_view::npos)
+			return false;
+
+		detail::unshare(env).set(name, value);
+		return true;
+	}
+
+	bool subprocess::CreateData::env_unset(const std::string_view& name)
+	{
+		if (name.empty() || name.find('=') != std::string_view::npos)
+			return false;
+
+		detail::unshare(env).unset(name);
+		return true;
+	}
+
+	subprocess::PreparedCommand::PreparedCommand(const CreateData& cd) noexcept
+		: data(cd)
+	{
+		prepare();
+	}
+
+	void subprocess::PreparedCommand::prepare() noexcept
+	{
+		pack(data);
+	}
+
+	void subprocess::PreparedCommand::pack(const CreateData& cd) noexcept
+	{
+		// [argv pointers..., nullptr][exe\0][argv[0]\0]...
+		const std::size_t pointers = (cd.argv.size() + 1) * sizeof(char*);
+
+		std::size_t total = pointers + cd.exe.size() + 1;
+		for (const auto& a : cd.argv)
+			total += a.size() + 1;
+
+		m_block.reset(new char[total]);
+
+		char** argv = reinterpret_cast<char**>(m_block.get());
+		char*  cursor = m_block.get() + pointers;
+
+		auto append = [&cursor](const std::string& str) {
+			char* begin = cursor;
+			std::memcpy(cursor, str.c_str(), str.size() + 1);
+			cursor += str.size() + 1;
+			return begin;
+		};
+
+		m_exe = append(cd.exe);
+		for (std::size_t i = 0; i < cd.argv.size(); i++)
+			argv[i] = append(cd.argv[i]);
+		argv[cd.argv.size()] = nullptr;
+	}
+
+	const char* subprocess::PreparedCommand::exe() const noexcept
+	{
+		return m_exe;
+	}
+
+	char* const* subprocess::PreparedCommand::argv() const noexcept
+	{
+		return reinterpret_cast<char* const*>(m_block.get());
+	}
+
 	subprocess::subprocess() noexcept
 	{
 	}
@@ -108,28 +232,94 @@ namespace splib
 	}
 	bool subprocess::joinable() noexcept
 	{
-		std::lock_guard<std::mutex> lock(m_process_mutex);
+		std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 		return m_process_handle != nullptr;
 	}
 	subprocess::subprocess(subprocess&& other) noexcept
 	{
-		std::lock_guard<std::mutex> lock(other.m_process_mutex);
+		std::lock_guard<detail::process_mutex> lock(other.m_process_mutex);
 		other.swap_no_lock(*this);
 	}
 	subprocess& subprocess::operator=(subprocess&& other) noexcept
 	{
 		subprocess tmp;
 		{
-			std::lock_guard<std::mutex> lock(other.m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(other.m_process_mutex);
 			other.swap_no_lock(tmp);
 		}
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 			tmp.swap_no_lock(*this);
 		}
 		return (*this);
 	}
 
+	bool subprocess::start(const CreateData& cd, stdfunc_t stdout_func, stdfunc_t stderr_func) noexcept
+	{
+		return start(cd, std::move(stdout_func), std::move(stderr_func), nullptr);
+	}
+	bool subprocess::start(const PreparedCommand& cmd, stdfunc_t stdout_func, stdfunc_t stderr_func) noexcept
+	{
+		return start(cmd, std::move(stdout_func), std::move(stderr_func), nullptr);
+	}
+	bool subprocess::start(const PreparedCommand& cmd, stdfunc_t stdout_func, stdfunc_t stderr_func, exitfunc_t exit_func) noexcept
+	{
+		SUBPROCESS_ASSERT(cmd.exe() != nullptr);
+		return start_command(cmd.data, cmd, std::move(stdout_func), std::move(stderr_func), std::move(exit_func), SinkRef(), SinkRef());
+	}
+
+	subprocess::CaptureResult subprocess::run_capture(const CreateData& cd) noexcept
+	{
+		return run_capture(cd, CaptureOptions());
+	}
+	subprocess::CaptureResult subprocess::run_capture(const CreateData& cd, const CaptureOptions& options) noexcept
+	{
+		CaptureResult result;
+
+		// the buffers are the sinks, output goes straight into them without std::function or locking
+		basic_subprocess<detail::capture_buffer, null_lock> p(detail::capture_buffer(options.stdout_hint, options.max_bytes), detail::capture_buffer(options.stderr_hint, options.max_bytes));
+		result.started = p.start(cd);
+		if (result.started == false)
+			return result;
+
+		if (options.stdin_data.empty() == false)
+			p.stdin_write(options.stdin_data.data(), options.stdin_data.size());
+		p.stdin_close();
+
+		result.rc = p.join();
+		result.out = p.stdout_sink().take();
+		result.err = p.stderr_sink().take();
+		result.out_truncated = p.stdout_sink().truncated();
+		result.err_truncated = p.stderr_sink().truncated();
+		return result;
+	}
+
+	int subprocess::join() noexcept
+	{
+		JoinResult result;
+		return join(result);
+	}
+	bool subprocess::try_join(int& rc) noexcept
+	{
+		JoinResult result;
+		if (try_join(result) == false)
+			return false;
+		rc = result.rc;
+		return true;
+	}
+	bool subprocess::join_for(const std::chrono::milliseconds timeout, int& rc) noexcept
+	{
+		return join_until(std::chrono::steady_clock::now() + timeout, rc);
+	}
+	bool subprocess::join_until(const std::chrono::steady_clock::time_point deadline, int& rc) noexcept
+	{
+		JoinResult result;
+		if (join_until(deadline, result) == false)
+			return false;
+		rc = result.rc;
+		return true;
+	}
+
 	bool subprocess::stdin_write(const std::string& data) noexcept
 	{
 		return stdin_write(data.c_str(), data.size());
@@ -137,7 +327,9 @@ namespace splib
 
 	void subprocess::stdin_close() noexcept
 	{
-		std::lock_guard<std::mutex> lock(m_process_mutex);
+		std::lock_guard<detail::process_mutex> lock(m_process_mutex);
+		if (m_stdin_pipe != nullptr)
+			m_stdin_pipe->close();
 		m_stdin_pipe.reset();
 	}
 
@@ -146,16 +338,21 @@ namespace splib
 		m_stdin_pipe.reset();
 		m_process_handle.reset();
 	}
+	std::unique_ptr<suprocess_impl> subprocess::release_no_lock() noexcept
+	{
+		m_stdin_pipe.reset();
+		return std::move(m_process_handle);
+	}
 
 	void subprocess::swap(subprocess& other) noexcept
 	{
 		subprocess tmp;
 		{
-			std::lock_guard<std::mutex> lock(m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(m_process_mutex);
 			tmp.swap_no_lock(*this);
 		}
 		{
-			std::lock_guard<std::mutex> lock(other.m_process_mutex);
+			std::lock_guard<detail::process_mutex> lock(other.m_process_mutex);
 			other.swap_no_lock(tmp);
 		}
 	}
@@ -165,4 +362,100 @@ namespace splib
 		m_stdin_pipe.swap(other.m_stdin_pipe);
 	}
 
+	subprocess_reactor::subprocess_reactor(const std::size_t thread_count, const std::size_t buffer_size) noexcept
+		: m_impl(std::make_unique<reactor_impl>(thread_count, buffer_size))
+	{
+	}
+	subprocess_reactor::~subprocess_reactor() noexcept
+	{
+	}
+	bool subprocess_reactor::valid() const noexcept
+	{
+		return m_impl->valid();
+	}
+	subprocess_reactor& subprocess_reactor::global() noexcept
+	{
+		static subprocess_reactor reactor;
+		return reactor;
+	}
+
+	subprocess_fork_server::subprocess_fork_server() noexcept
+		: m_impl(std::make_unique<fork_server_impl>())
+	{
+	}
+	subprocess_fork_server::~subprocess_fork_server() noexcept
+	{
+	}
+	bool subprocess_fork_server::start(entryfunc_t entry) noexcept
+	{
+		m_entry = std::move(entry);
+		return m_impl->start(m_entry);
+	}
+	void subprocess_fork_server::stop() noexcept
+	{
+		m_impl->stop();
+	}
+	bool subprocess_fork_server::valid() const noexcept
+	{
+		return m_impl->valid();
+	}
+
+	subprocess_pool::subprocess_pool(const std::size_t max_running) noexcept
+		: m_impl(std::make_unique<pool_impl>(max_running))
+	{
+	}
+	subprocess_pool::~subprocess_pool() noexcept
+	{
+		m_impl->wait();
+	}
+	std::size_t subprocess_pool::submit(const subprocess::CreateData& cd, subprocess::stdfunc_t stdout_func, subprocess::stdfunc_t stderr_func, subprocess::exitfunc_t exit_func) noexcept
+	{
+		return m_impl->submit(cd, std::move(stdout_func), std::move(stderr_func), std::move(exit_func));
+	}
+	std::vector<int> subprocess_pool::wait() noexcept
+	{
+		return m_impl->wait();
+	}
+	std::size_t subprocess_pool::running() noexcept
+	{
+		return m_impl->running();
+	}
+
+	subprocess_pipeline::subprocess_pipeline() noexcept
+		: m_impl(std::make_unique<pipeline_impl>())
+	{
+	}
+	subprocess_pipeline::~subprocess_pipeline() noexcept
+	{
+		SUBPROCESS_ASSERT(joinable() == false);
+	}
+	bool subprocess_pipeline::start(const std::vector<subprocess::CreateData>& stages, subprocess::stdfunc_t stdout_func, subprocess::stdfunc_t stderr_func) noexcept
+	{
+		return m_impl->start(stages, std::move(stdout_func), std::move(stderr_func));
+	}
+	bool subprocess_pipeline::joinable() noexcept
+	{
+		return m_impl->joinable();
+	}
+	std::vector<int> subprocess_pipeline::join() noexcept
+	{
+		return m_impl->join();
+	}
+	void subprocess_pipeline::stdin_close() noexcept
+	{
+		m_impl->stdin_close();
+	}
+	bool subprocess_pipeline::stdin_write(const std::string& data) noexcept
+	{
+		return m_impl->stdin_write(data.c_str(), data.size());
+	}
+	bool subprocess_pipeline::stdin_write(const char* bytes, size_t n) noexcept
+	{
+		return m_impl->stdin_write(bytes, n);
+	}
+	void subprocess_pipeline::kill() noexcept
+	{
+		m_impl->kill();
+	}
+
 }
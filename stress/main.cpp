@@ -0,0 +1,200 @@
+
+#include "subprocess.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <atomic>
+
+#include <dirent.h>
+#include <sys/resource.h>
+
+using namespace splib;
+
+using clock_type = std::chrono::steady_clock;
+
+// one json object per line on stdout, like the benchmarks
+class record
+{
+public:
+	record(const char* stress, const std::string& variant)
+	{
+		m_line.precision(15);
+		m_line << "{\"stress\":\"" << stress << "\",\"variant\":\"" << variant << "\"";
+	}
+	~record()
+	{
+		m_line << "}";
+		std::cout << m_line.str() << std::endl;
+	}
+
+	record& value(const char* name, const double v)
+	{
+		m_line << ",\"" << name << "\":" << v;
+		return *this;
+	}
+
+protected:
+	std::ostringstream m_line;
+};
+
+struct usage
+{
+	//^ what the parent pays for its children right now
+	std::size_t threads = 0;
+	std::size_t fds = 0;
+	std::size_t rss_kb = 0;
+
+	static usage now()
+	{
+		usage u;
+
+		std::ifstream f("/proc/self/status");
+		std::string	  line;
+		while (std::getline(f, line))
+		{
+			if (line.compare(0, 8, "Threads:") == 0)
+				u.threads = std::size_t(std::stoul(line.substr(8)));
+			else if (line.compare(0, 6, "VmRSS:") == 0)
+				u.rss_kb = std::size_t(std::stoul(line.substr(6)));
+		}
+
+		if (DIR* d = opendir("/proc/self/fd"))
+		{
+			while (dirent* e = readdir(d))
+			{
+				if (e->d_name[0] != '.')
+					u.fds++;
+			}
+			closedir(d);
+			u.fds--; // the one opendir holds
+		}
+		return u;
+	}
+};
+
+std::size_t raise_fd_limit()
+{
+	//^ every child costs the parent a few pipe ends and a pidfd; returns the limit in effect
+	rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) != 0)
+		return 0;
+	if (lim.rlim_cur < lim.rlim_max)
+	{
+		lim.rlim_cur = lim.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &lim) != 0)
+			getrlimit(RLIMIT_NOFILE, &lim);
+	}
+	return std::size_t(lim.rlim_cur);
+}
+
+bool concurrent_children(const std::size_t count, subprocess_reactor* reactor, const std::size_t fd_limit)
+{
+	//^ count cat processes alive at once, each answering one line once all are up; false if not all of them could be started
+	subprocess::CreateData cd;
+	cd.exe = "/bin/cat";
+	cd.argv = { "cat" };
+	cd.reactor = reactor;
+
+	std::atomic<std::size_t> received{ 0 };
+	auto					 sout = [&received](const char*, const std::size_t sz) {
+		received += sz;
+	};
+
+	auto before = usage::now();
+	auto begin = clock_type::now();
+
+	// the process state lives on the heap, the output threads don't mind the vector moving the objects
+	std::vector<subprocess> processes;
+	processes.reserve(count);
+	for (std::size_t i = 0; i < count; i++)
+	{
+		subprocess p;
+		if (p.start(cd, sout, nullptr) == false)
+			break;
+		processes.push_back(std::move(p));
+	}
+
+	auto started = clock_type::now();
+	auto peak = usage::now();
+
+	const std::string line = "ping\n";
+	std::size_t		  failed_writes = 0;
+	for (auto& p : processes)
+	{
+		if (p.stdin_write(line) == false)
+			failed_writes++;
+		p.stdin_close();
+	}
+
+	std::size_t bad_exits = 0;
+	for (auto& p : processes)
+	{
+		if (p.join() != 0)
+			bad_exits++;
+	}
+	auto done = clock_type::now();
+
+	const std::size_t running = processes.size();
+	processes.clear();
+	auto after = usage::now();
+
+	record("concurrent_children", reactor != nullptr ? "reactor" : "thread_per_child")
+		.value("children", double(count))
+		.value("started", double(running))
+		.value("fd_limit", double(fd_limit))
+		.value("failed_writes", double(failed_writes))
+		.value("bad_exits", double(bad_exits))
+		.value("lost_bytes", double(running * line.size() - received))
+		.value("threads", double(peak.threads - before.threads))
+		.value("fds", double(peak.fds - before.fds))
+		.value("rss_kb", double(peak.rss_kb > before.rss_kb ? peak.rss_kb - before.rss_kb : 0))
+		.value("leaked_fds", double(after.fds > before.fds ? after.fds - before.fds : 0))
+		.value("start_s", std::chrono::duration<double>(started - begin).count())
+		.value("complete_s", std::chrono::duration<double>(done - begin).count());
+
+	return running == count;
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t max_children = 10000;
+	bool		use_threads = true;
+	bool		use_reactor = true;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg.rfind("--max=", 0) == 0)
+			max_children = std::size_t(std::stoul(arg.substr(6)));
+		else if (arg == "--reactor-only")
+			use_threads = false;
+		else if (arg == "--threads-only")
+			use_reactor = false;
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--max=children] [--reactor-only | --threads-only]" << std::endl;
+			return 1;
+		}
+	}
+
+	const std::size_t fd_limit = raise_fd_limit();
+
+	subprocess_reactor reactor;
+
+	// doubles until max_children, a level that can't be started in full ends the ramp for that variant
+	for (int variant = 0; variant < 2; variant++)
+	{
+		if ((variant == 0 && use_threads == false) || (variant == 1 && use_reactor == false))
+			continue;
+
+		for (std::size_t count = 100;; count = std::min(count * 2, max_children))
+		{
+			if (concurrent_children(count, variant == 1 ? &reactor : nullptr, fd_limit) == false || count == max_children)
+				break;
+		}
+	}
+
+	return 0;
+}
@@ -2,7 +2,20 @@
 #include "subprocess.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <thread>
+#include <atomic>
+#include <cstdlib>
+
+#ifdef __GNUC__
+#	include <poll.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/stat.h>
+#	include <sys/resource.h>
+#	include <sys/wait.h>
+#	include <signal.h>
+#endif
 
 using namespace splib;
 
@@ -256,6 +269,1289 @@ void test_kill_shell()
 	TTF_ASSERT(serr.empty());
 }
 
+void test_reactor_shell()
+{
+	subprocess_reactor reactor(2, 4096);
+	TTF_ASSERT(reactor.valid());
+
+	constexpr std::size_t count = 32;
+
+	result	   r[count];
+	subprocess p[count];
+
+	subprocess::CreateData cd;
+	cd.reactor = &reactor;
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		auto sout = [&r, i](const char* buffer, const std::size_t sz) {
+			r[i].sout += std::string(buffer, sz);
+		};
+		auto serr = [&r, i](const char* buffer, const std::size_t sz) {
+			r[i].serr += std::string(buffer, sz);
+		};
+
+		TTF_ASSERT(cd.make_shell("echo out" + std::to_string(i) + " && echo err >&2 && exit " + std::to_string(i % 4)));
+		TTF_ASSERT(p[i].start(cd, sout, serr));
+	}
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		r[i].rc = p[i].join();
+
+		TTF_ASSERT(r[i].rc == int(i % 4));
+		TTF_ASSERT(r[i].sout == "out" + std::to_string(i) + "\n");
+		TTF_ASSERT(r[i].serr == "err\n");
+	}
+}
+
+void test_reactor_cross_process_shell()
+{
+	// a callback of one process uses another process on the same loop while that one is joined
+	subprocess_reactor reactor(1, 4096);
+	TTF_ASSERT(reactor.valid());
+
+	subprocess::CreateData cd;
+	cd.reactor = &reactor;
+
+	subprocess		  b;
+	std::atomic<bool> in_callback{ false };
+	TTF_ASSERT(cd.make_shell("cat"));
+	TTF_ASSERT(b.start(cd, [](const char*, const std::size_t) {}, nullptr));
+
+	subprocess a;
+	TTF_ASSERT(cd.make_shell("echo a"));
+	TTF_ASSERT(a.start(cd, [&](const char*, const std::size_t) {
+		in_callback = true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		b.stdin_write("x");
+	}, nullptr));
+
+	while (in_callback == false)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	auto begin = std::chrono::steady_clock::now();
+	b.stdin_close();
+	TTF_ASSERT(b.join() == 0);
+	TTF_ASSERT(a.join() == 0);
+	TTF_ASSERT(std::chrono::steady_clock::now() - begin < std::chrono::seconds(5));
+}
+
+void test_io_uring_shell()
+{
+	result				   r;
+	subprocess::CreateData cd;
+	cd.use_io_uring = true;
+	cd.buffer_size = 4096;
+
+	TTF_ASSERT(cd.make_shell("head -c 1000000 /dev/zero | tr '\\0' 'x' && echo err >&2 && exit 5"));
+	run(r, cd);
+
+	TTF_ASSERT(r.rc == 5);
+	TTF_ASSERT(r.sout == std::string(1000000, 'x'));
+	TTF_ASSERT(r.serr == "err\n");
+}
+
+void test_try_join_shell()
+{
+	subprocess			   p;
+	subprocess::CreateData cd;
+
+	int rc = -1;
+	TTF_ASSERT(p.try_join(rc) == false);
+
+	TTF_ASSERT(cd.make_shell("sleep 0.2 && exit 4"));
+	TTF_ASSERT(p.start(cd, nullptr, nullptr));
+	TTF_ASSERT(p.try_join(rc) == false);
+
+	int fd = p.exit_fd();
+	if (fd != -1)
+	{
+		pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		TTF_ASSERT(poll(&pfd, 1, 5000) == 1);
+		TTF_ASSERT(p.try_join(rc));
+	}
+	else
+	{
+		while (p.try_join(rc) == false)
+			ttf::utils::wait_miliseconds(10);
+	}
+
+	TTF_ASSERT(rc == 4);
+	TTF_ASSERT(p.joinable() == false);
+}
+
+void test_kill_timeout_shell()
+{
+	subprocess			   p;
+	subprocess::CreateData cd;
+	cd.kill_timeout = std::chrono::milliseconds(5000);
+
+	TTF_ASSERT(cd.make_shell("exec sleep 10"));
+	TTF_ASSERT(p.start(cd, nullptr, nullptr));
+
+	int pid_fd = p.exit_fd();
+
+	// sleep exits on SIGTERM, so kill returns as soon as it is gone instead of waiting the full timeout
+	auto begin = std::chrono::steady_clock::now();
+	p.kill();
+	auto elapsed = std::chrono::steady_clock::now() - begin;
+
+	TTF_ASSERT(p.joinable() == false);
+	if (pid_fd != -1)
+	{
+		TTF_ASSERT(elapsed < std::chrono::milliseconds(2500));
+
+		// reaped by kill, no zombie left behind
+		siginfo_t info;
+		info.si_pid = 0;
+		TTF_ASSERT(waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0);
+	}
+
+	subprocess_fork_server server;
+	TTF_ASSERT(server.start());
+
+	for (int i = 0; i < 20; i++)
+	{
+		// killed while another thread waits in join on the exit state, kill does the reap and has to wake it
+		subprocess::CreateData stubborn;
+		TTF_ASSERT(stubborn.make_shell("trap '' TERM; sleep 5"));
+		stubborn.kill_timeout = std::chrono::milliseconds(1);
+		stubborn.fork_server = i % 2 == 1 ? &server : nullptr; // or the fork server reaps it and reports back
+
+		subprocess q;
+		TTF_ASSERT(q.start(stubborn, nullptr, nullptr, [](int) {}));
+
+		auto		start = std::chrono::steady_clock::now();
+		std::thread t([&]() { q.join(); });
+		ttf::utils::wait_miliseconds(50);
+		q.kill();
+		t.join();
+		TTF_ASSERT(std::chrono::steady_clock::now() - start < std::chrono::seconds(4));
+	}
+
+	server.stop();
+}
+
+void test_on_exit(subprocess::CreateData& cd)
+{
+	constexpr std::size_t count = 8;
+
+	result			 r[count];
+	std::string		 sout_at_exit[count];
+	subprocess		 p[count];
+	std::atomic<int> exited{ 0 };
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		auto sout = [&r, i](const char* buffer, const std::size_t sz) {
+			r[i].sout += std::string(buffer, sz);
+		};
+		auto on_exit = [&, i](const int rc) {
+			r[i].rc = rc;
+			sout_at_exit[i] = r[i].sout;
+			exited++;
+		};
+
+		TTF_ASSERT(cd.make_shell("echo out" + std::to_string(i) + " && exit " + std::to_string(i)));
+		TTF_ASSERT(p[i].start(cd, sout, nullptr, on_exit));
+	}
+
+	while (exited != int(count))
+		ttf::utils::wait_miliseconds(1);
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		TTF_ASSERT(r[i].rc == int(i));
+		TTF_ASSERT(sout_at_exit[i] == "out" + std::to_string(i) + "\n");
+
+		int rc = -1;
+		TTF_ASSERT(p[i].try_join(rc));
+		TTF_ASSERT(rc == int(i));
+	}
+}
+
+void test_on_exit_shell()
+{
+	subprocess::CreateData cd;
+	test_on_exit(cd);
+
+	cd.use_io_uring = true;
+	test_on_exit(cd);
+
+	subprocess_reactor reactor;
+	cd.reactor = &reactor;
+	test_on_exit(cd);
+
+	{
+		// a failed start must not reap some other child of this process
+		subprocess::CreateData other;
+		TTF_ASSERT(other.make_shell("sleep 0.3; exit 3"));
+		subprocess running;
+		TTF_ASSERT(running.start(other, nullptr, nullptr));
+
+		subprocess::CreateData missing;
+		missing.exe = "/nonexistent/executable";
+		missing.argv = { "executable" };
+		subprocess failed;
+		auto	   begin = std::chrono::steady_clock::now();
+		TTF_ASSERT(failed.start(missing, nullptr, nullptr, [](int) {}) == false);
+		TTF_ASSERT(std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(200));
+		TTF_ASSERT(running.join() == 3);
+	}
+}
+
+void test_pool_shell()
+{
+	constexpr std::size_t count = 24;
+	constexpr std::size_t max_running = 3;
+
+	subprocess_pool pool(max_running);
+
+	std::string		 sout[count];
+	std::atomic<int> exited{ 0 };
+
+	subprocess::CreateData cd;
+	for (std::size_t i = 0; i < count; i++)
+	{
+		auto fout = [&sout, i](const char* buffer, const std::size_t sz) {
+			sout[i] += std::string(buffer, sz);
+		};
+		auto on_exit = [&](const int) {
+			exited++;
+		};
+
+		TTF_ASSERT(cd.make_shell("sleep 0.01 && echo " + std::to_string(i) + " && exit " + std::to_string(i % 5)));
+		TTF_ASSERT(pool.submit(cd, fout, nullptr, on_exit) == i);
+		TTF_ASSERT(pool.running() <= max_running);
+	}
+
+	cd.exe = "/nonexistent/executable";
+	TTF_ASSERT(pool.submit(cd) == count);
+
+	auto rc = pool.wait();
+	TTF_ASSERT(rc.size() == count + 1);
+	TTF_ASSERT(exited == int(count));
+	TTF_ASSERT(pool.running() == 0);
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		TTF_ASSERT(rc[i] == int(i % 5));
+		TTF_ASSERT(sout[i] == std::to_string(i) + "\n");
+	}
+	TTF_ASSERT(rc[count] != 0);
+
+	// the pool starts a new batch after wait
+	TTF_ASSERT(cd.make_shell("exit 7"));
+	TTF_ASSERT(pool.submit(cd) == 0);
+	TTF_ASSERT(pool.wait() == std::vector<int>{ 7 });
+}
+
+void test_fork_server_shell()
+{
+	subprocess_fork_server server;
+	TTF_ASSERT(server.start([](const std::vector<std::string>& argv) {
+		// nothing of the server's but stdio may be open here
+		int inherited = 0;
+		for (int fd = 3; fd < 1024; fd++)
+			inherited += fcntl(fd, F_GETFD) != -1 ? 1 : 0;
+		std::string msg = "entry:" + argv[0] + ":" + std::to_string(inherited);
+		TTF_ASSERT(::write(STDOUT_FILENO, msg.data(), msg.size()) == ssize_t(msg.size()));
+		return 9;
+	}));
+	TTF_ASSERT(server.valid());
+
+	result				   r;
+	subprocess::CreateData cd;
+	cd.fork_server = &server;
+
+	TTF_ASSERT(cd.make_shell("echo hello && echo err >&2 && exit 3"));
+	run(r, cd);
+	TTF_ASSERT(r.rc == 3);
+	TTF_ASSERT(r.sout == "hello\n");
+	TTF_ASSERT(r.serr == "err\n");
+
+	// stdin is wired to the helper's child too
+	{
+		subprocess p;
+		std::string sout;
+		TTF_ASSERT(cd.make_shell("cat"));
+		TTF_ASSERT(p.start(cd, [&](const char* buffer, const std::size_t sz) { sout += std::string(buffer, sz); }, nullptr));
+		TTF_ASSERT(p.stdin_write("piped"));
+		p.stdin_close();
+		TTF_ASSERT(p.join() == 0);
+		TTF_ASSERT(sout == "piped");
+	}
+
+	test_on_exit(cd);
+
+	cd.exe.clear();
+	cd.argv = { "zygote" };
+	result e;
+	run(e, cd);
+	TTF_ASSERT(e.rc == 9);
+	TTF_ASSERT(e.sout == "entry:zygote:0");
+
+	cd.exe = "/nonexistent/executable";
+	subprocess p;
+	TTF_ASSERT(p.start(cd, nullptr, nullptr) == false);
+
+	server.stop();
+	TTF_ASSERT(server.valid() == false);
+}
+
+void test_spawn_strategy_shell()
+{
+	const subprocess::spawn_strategy_t strategies[] = {
+		subprocess::spawn_strategy_t::posix_spawn,
+		subprocess::spawn_strategy_t::vfork,
+		subprocess::spawn_strategy_t::clone_vfork,
+	};
+
+	for (auto strategy : strategies)
+	{
+		result				   r;
+		subprocess::CreateData cd;
+		cd.spawn_strategy = strategy;
+		cd.cwd = "/tmp";
+
+		TTF_ASSERT(cd.make_shell("pwd && read line && echo $line >&2 && exit 6"));
+
+		subprocess p;
+		auto	   sout = [&](const char* buffer, const std::size_t sz) { r.sout += std::string(buffer, sz); };
+		auto	   serr = [&](const char* buffer, const std::size_t sz) { r.serr += std::string(buffer, sz); };
+		TTF_ASSERT(p.start(cd, sout, serr));
+		TTF_ASSERT(p.stdin_write("line\n"));
+		TTF_ASSERT(p.join() == 6);
+		TTF_ASSERT(r.sout == "/tmp\n");
+		TTF_ASSERT(r.serr == "line\n");
+
+		cd.exe = "/nonexistent/executable";
+		TTF_ASSERT(p.start(cd, nullptr, nullptr) == false);
+	}
+}
+
+void test_prepared_command_shell()
+{
+	subprocess::CreateData cd;
+	TTF_ASSERT(cd.make_shell("pwd && echo $0 $HOME"));
+
+	subprocess::PreparedCommand cmd(cd);
+	TTF_ASSERT(std::string(cmd.exe()) == "/bin/sh");
+	TTF_ASSERT(std::string(cmd.argv()[2]) == "pwd && echo $0 $HOME");
+	TTF_ASSERT(cmd.argv()[3] == nullptr);
+
+	const char* cwds[] = { "/tmp", "/" };
+	for (auto cwd : cwds)
+	{
+		cmd.data.cwd = cwd;
+
+		result	   r;
+		subprocess p;
+		TTF_ASSERT(p.start(
+			cmd, [&](const char* buffer, const std::size_t sz) { r.sout += std::string(buffer, sz); }, nullptr));
+		TTF_ASSERT(p.join() == 0);
+		TTF_ASSERT(r.sout == std::string(cwd) + "\nsh " + std::getenv("HOME") + "\n");
+	}
+}
+
+void test_search_path_shell()
+{
+	const std::string dir = "/tmp/subprocess_search_path";
+	const std::string tool = dir + "/subprocess_test_tool";
+	const std::string old_path = std::getenv("PATH");
+
+	auto install = [&](const char* script) {
+		unlink(tool.c_str());
+		std::ofstream(tool) << script;
+		TTF_ASSERT(chmod(tool.c_str(), 0755) == 0);
+	};
+	auto run = [&]() {
+		result				   r;
+		subprocess::CreateData cd;
+		cd.exe = "subprocess_test_tool";
+		cd.argv.push_back(cd.exe);
+		cd.search_path = true;
+
+		subprocess p;
+		if (p.start(cd, [&](const char* buffer, const std::size_t sz) { r.sout += std::string(buffer, sz); }, nullptr) == false)
+			return std::string("<failed>");
+		p.join();
+		return r.sout;
+	};
+
+	mkdir(dir.c_str(), 0755);
+	install("#!/bin/sh\necho first\n");
+
+	TTF_ASSERT(run() == "<failed>");
+
+	setenv("PATH", (dir + ":" + old_path).c_str(), 1);
+	TTF_ASSERT(run() == "first\n");
+	TTF_ASSERT(run() == "first\n");
+
+	// replaced file, the cached entry no longer matches
+	install("#!/bin/sh\necho second\n");
+	TTF_ASSERT(run() == "second\n");
+
+	// no longer executable, the next directory in PATH has one
+	const std::string fallback_dir = dir + "_fallback";
+	const std::string fallback = fallback_dir + "/subprocess_test_tool";
+	mkdir(fallback_dir.c_str(), 0755);
+	std::ofstream(fallback) << "#!/bin/sh\necho fallback\n";
+	TTF_ASSERT(chmod(fallback.c_str(), 0755) == 0);
+	setenv("PATH", (dir + ":" + fallback_dir + ":" + old_path).c_str(), 1);
+	TTF_ASSERT(run() == "second\n");
+	TTF_ASSERT(chmod(tool.c_str(), 0644) == 0);
+	TTF_ASSERT(run() == "fallback\n");
+
+	setenv("PATH", old_path.c_str(), 1);
+	TTF_ASSERT(run() == "<failed>");
+
+	unlink(fallback.c_str());
+	rmdir(fallback_dir.c_str());
+	unlink(tool.c_str());
+	rmdir(dir.c_str());
+}
+
+void test_environment_shell()
+{
+	subprocess::CreateData cd;
+	TTF_ASSERT(cd.make_shell("echo \"$SUBPROCESS_A|$SUBPROCESS_B|${HOME:-unset}\""));
+	TTF_ASSERT(cd.env_set("SUBPROCESS_A", "a"));
+	TTF_ASSERT(cd.env_unset("HOME"));
+	TTF_ASSERT(cd.env_set("BAD=NAME", "x") == false);
+
+	subprocess::CreateData copy = cd;
+	TTF_ASSERT(copy.env == cd.env);
+	TTF_ASSERT(copy.env_set("SUBPROCESS_B", "b"));
+	TTF_ASSERT(copy.env != cd.env);
+
+	auto run = [](const subprocess::CreateData& c) {
+		result	   r;
+		subprocess p;
+		TTF_ASSERT(p.start(c, [&](const char* buffer, const std::size_t sz) { r.sout += std::string(buffer, sz); }, nullptr));
+		TTF_ASSERT(p.join() == 0);
+		return r.sout;
+	};
+
+	subprocess_fork_server server;
+	TTF_ASSERT(server.start());
+
+	for (int i = 0; i < 3; i++)
+	{
+		cd.spawn_strategy = copy.spawn_strategy = i == 1 ? subprocess::spawn_strategy_t::vfork : subprocess::spawn_strategy_t::posix_spawn;
+		cd.fork_server = copy.fork_server = i == 2 ? &server : nullptr;
+
+		TTF_ASSERT(run(cd) == "a||unset\n");
+		TTF_ASSERT(run(copy) == "a|b|unset\n");
+	}
+
+	server.stop();
+
+	// the parent's environment is taken once per overlay, changing the overlay takes it again
+	subprocess::CreateData snap;
+	TTF_ASSERT(snap.make_shell("echo \"${SUBPROCESS_C:-unset}\""));
+	TTF_ASSERT(snap.env_set("SUBPROCESS_A", "a"));
+	TTF_ASSERT(run(snap) == "unset\n");
+	setenv("SUBPROCESS_C", "c", 1);
+	TTF_ASSERT(run(snap) == "unset\n");
+	TTF_ASSERT(snap.env_set("SUBPROCESS_A", "a"));
+	TTF_ASSERT(run(snap) == "c\n");
+	unsetenv("SUBPROCESS_C");
+}
+
+void test_redirect_shell()
+{
+	const std::string log = "/tmp/subprocess_redirect.log";
+
+	auto read_file = [](const std::string& path) {
+		std::ifstream	  f(path);
+		std::stringstream ss;
+		ss << f.rdbuf();
+		return ss.str();
+	};
+	auto fail = [](const char*, const std::size_t) { TTF_ASSERT(false); };
+
+	subprocess::CreateData cd;
+	TTF_ASSERT(cd.make_shell("echo out && echo err >&2 && exit 3"));
+
+	{
+		// nothing captured, no pipes or thread
+		cd.stdout_redirect = subprocess::Redirect::to_file(log);
+		cd.stderr_redirect = subprocess::Redirect::to_null();
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, fail, fail));
+		TTF_ASSERT(p.join() == 3);
+		TTF_ASSERT(read_file(log) == "out\n");
+	}
+
+	{
+		// only stderr redirected, appended to the same file through a caller owned fd
+		int fd = open(log.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+		TTF_ASSERT(fd != -1);
+		cd.stdout_redirect = subprocess::Redirect();
+		cd.stderr_redirect = subprocess::Redirect::to_fd(fd);
+		cd.spawn_strategy = subprocess::spawn_strategy_t::vfork;
+
+		result	   r;
+		subprocess p;
+		TTF_ASSERT(p.start(
+			cd, [&](const char* buffer, const std::size_t sz) { r.sout += std::string(buffer, sz); }, fail, [&](const int rc) { r.rc = rc; }));
+		TTF_ASSERT(p.join() == 3);
+		TTF_ASSERT(r.rc == 3);
+		TTF_ASSERT(r.sout == "out\n");
+		TTF_ASSERT(read_file(log) == "out\nerr\n");
+		close(fd);
+	}
+
+	{
+		cd.stderr_redirect = subprocess::Redirect::to_null();
+		cd.reactor = &subprocess_reactor::global();
+
+		result	   r;
+		subprocess p;
+		TTF_ASSERT(p.start(
+			cd, [&](const char* buffer, const std::size_t sz) { r.sout += std::string(buffer, sz); }, fail, [&](const int rc) { r.rc = rc; }));
+		TTF_ASSERT(p.join() == 3);
+		TTF_ASSERT(r.rc == 3);
+		TTF_ASSERT(r.sout == "out\n");
+	}
+
+	cd.stdout_redirect = subprocess::Redirect::to_file("/nonexistent/dir/log");
+	subprocess p;
+	TTF_ASSERT(p.start(cd, nullptr, nullptr) == false);
+
+	unlink(log.c_str());
+
+	// the caller's own stdout and stderr as targets, the child's other stream is captured and must not get them
+	const std::string log_out = log + ".1";
+	const std::string log_err = log + ".2";
+	std::fflush(stdout);
+	std::fflush(stderr);
+	const int saved_out = dup(STDOUT_FILENO);
+	const int saved_err = dup(STDERR_FILENO);
+
+	const subprocess::spawn_strategy_t strategies[] = {
+		subprocess::spawn_strategy_t::posix_spawn,
+		subprocess::spawn_strategy_t::vfork,
+		subprocess::spawn_strategy_t::clone_vfork,
+	};
+	for (auto strategy : strategies)
+	{
+		int out_fd = open(log_out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		int err_fd = open(log_err.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		dup2(out_fd, STDOUT_FILENO);
+		dup2(err_fd, STDERR_FILENO);
+		close(out_fd);
+		close(err_fd);
+
+		subprocess::CreateData to_std;
+		TTF_ASSERT(to_std.make_shell("echo out && echo err >&2"));
+		to_std.spawn_strategy = strategy;
+
+		result r1;
+		to_std.stderr_redirect = subprocess::Redirect::to_fd(STDOUT_FILENO);
+		run(r1, to_std);
+
+		result r2;
+		to_std.stderr_redirect = subprocess::Redirect();
+		to_std.stdout_redirect = subprocess::Redirect::to_fd(STDERR_FILENO);
+		run(r2, to_std);
+
+		dup2(saved_out, STDOUT_FILENO);
+		dup2(saved_err, STDERR_FILENO);
+
+		TTF_ASSERT(r1.sout == "out\n" && r1.serr.empty());
+		TTF_ASSERT(read_file(log_out) == "err\n");
+		TTF_ASSERT(r2.sout.empty() && r2.serr == "err\n");
+		TTF_ASSERT(read_file(log_err) == "out\n");
+	}
+
+	close(saved_out);
+	close(saved_err);
+	unlink(log_out.c_str());
+	unlink(log_err.c_str());
+}
+
+void test_pipeline_shell()
+{
+	auto stage = [](const char* cmdline) {
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell(cmdline));
+		return cd;
+	};
+
+	{
+		result				r;
+		subprocess_pipeline p;
+		TTF_ASSERT(p.start(
+			{ stage("printf 'b\\na\\nc\\n'"), stage("sort; echo sorted >&2"), stage("tr a-z A-Z; exit 4") },
+			[&](const char* buffer, const std::size_t sz) { r.sout += std::string(buffer, sz); },
+			[&](const char* buffer, const std::size_t sz) { r.serr += std::string(buffer, sz); }));
+		TTF_ASSERT(p.join() == std::vector<int>({ 0, 0, 4 }));
+		TTF_ASSERT(r.sout == "A\nB\nC\n");
+		TTF_ASSERT(r.serr == "sorted\n");
+	}
+
+	{
+		// stdin of the pipeline is the first stage's
+		result				r;
+		subprocess_pipeline p;
+		TTF_ASSERT(p.start(
+			{ stage("cat"), stage("wc -l") }, [&](const char* buffer, const std::size_t sz) { r.sout += std::string(buffer, sz); }, nullptr));
+		TTF_ASSERT(p.stdin_write("1\n2\n3\n"));
+		p.stdin_close();
+		TTF_ASSERT(p.join() == std::vector<int>({ 0, 0 }));
+		TTF_ASSERT(r.sout.find('3') != std::string::npos);
+	}
+
+	{
+		auto bad = stage("cat");
+		bad.exe = "/nonexistent/executable";
+
+		subprocess_pipeline p;
+		TTF_ASSERT(p.start({ stage("cat"), bad }, nullptr, nullptr) == false);
+		TTF_ASSERT(p.joinable() == false);
+	}
+}
+
+void test_tee_shell()
+{
+	const std::string log = "/tmp/subprocess_tee.log";
+
+	auto read_file = [](const std::string& path) {
+		std::ifstream	  f(path);
+		std::stringstream ss;
+		ss << f.rdbuf();
+		return ss.str();
+	};
+
+	subprocess::CreateData cd;
+	TTF_ASSERT(cd.make_shell("seq 1 20000 && echo err >&2"));
+
+	std::string expected;
+	for (int i = 1; i <= 20000; i++)
+		expected += std::to_string(i) + "\n";
+
+	subprocess_reactor reactor;
+	for (int mode = 0; mode < 3; mode++)
+	{
+		// plain file (spliced), append mode (may fall back to write) and through a reactor
+		cd.stdout_tee = subprocess::Redirect::to_file(log, mode == 1);
+		cd.stderr_tee = subprocess::Redirect::to_null();
+		cd.reactor = mode == 2 ? &reactor : nullptr;
+		unlink(log.c_str());
+
+		result	   r;
+		subprocess p;
+		TTF_ASSERT(p.start(
+			cd, [&](const char* buffer, const std::size_t sz) { r.sout += std::string(buffer, sz); },
+			[&](const char* buffer, const std::size_t sz) { r.serr += std::string(buffer, sz); }));
+		TTF_ASSERT(p.join() == 0);
+		TTF_ASSERT(r.sout == expected);
+		TTF_ASSERT(r.serr == "err\n");
+		TTF_ASSERT(read_file(log) == expected);
+	}
+
+	unlink(log.c_str());
+}
+
+void test_stdin_async_shell()
+{
+	const std::size_t chunk = 65536;
+	const std::size_t total = 64 * chunk;
+
+	subprocess_reactor reactor;
+	for (int mode = 0; mode < 4; mode++)
+	{
+		// select thread, io_uring, reactor, and no background thread at all
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("cat"));
+		cd.use_io_uring = mode == 1;
+		cd.reactor = mode == 2 ? &reactor : nullptr;
+		cd.stdin_high_water = 4 * chunk;
+		if (mode == 3)
+			cd.stdout_redirect = subprocess::Redirect::to_null();
+
+		std::atomic<std::size_t> received{ 0 };
+		std::atomic<std::size_t> completed{ 0 };
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, [&](const char*, const std::size_t sz) { received += sz; }, nullptr));
+
+		for (std::size_t i = 0; i < total / chunk; i++)
+		{
+			TTF_ASSERT(p.stdin_wait_writable(std::chrono::seconds(10)));
+			TTF_ASSERT(p.stdin_write_async(std::string(chunk, 'x'), [&](const bool ok) {
+				TTF_ASSERT(ok);
+				completed++;
+			}));
+		}
+		// blocking writes queue up behind the async ones
+		TTF_ASSERT(p.stdin_write(std::string(chunk, 'y')));
+		TTF_ASSERT(p.stdin_flush());
+		TTF_ASSERT(p.stdin_pending() == 0);
+		TTF_ASSERT(completed == total / chunk);
+
+		p.stdin_close();
+		TTF_ASSERT(p.join() == 0);
+		if (mode != 3)
+			TTF_ASSERT(received == total + chunk);
+	}
+
+	{
+		// a child that never reads only holds up the data, not the caller
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("sleep 5"));
+		cd.stdin_high_water = chunk;
+
+		std::atomic<int> failed{ 0 };
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, nullptr, nullptr));
+		for (int i = 0; i < 32; i++)
+			TTF_ASSERT(p.stdin_write_async(std::string(chunk, 'x'), [&](const bool ok) { failed += ok ? 0 : 1; }));
+
+		TTF_ASSERT(p.stdin_pending() > 0);
+		TTF_ASSERT(p.stdin_wait_writable(std::chrono::milliseconds(20)) == false);
+
+		auto begin = std::chrono::steady_clock::now();
+		p.kill();
+		TTF_ASSERT(std::chrono::steady_clock::now() - begin < std::chrono::seconds(2));
+		TTF_ASSERT(failed > 0);
+		TTF_ASSERT(p.stdin_write_async("late") == false);
+	}
+
+	for (int i = 0; i < 50; i++)
+	{
+		// killed while another thread keeps writing, a write that already holds the pipe must not rearm the reactor's watch
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("cat"));
+		cd.reactor = &reactor;
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, [](const char*, const std::size_t) {}, nullptr));
+
+		std::thread writer([&]() {
+			// writes into a child that is gone raise SIGPIPE in the writing thread
+			sigset_t mask;
+			sigemptyset(&mask);
+			sigaddset(&mask, SIGPIPE);
+			pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+			while (p.stdin_write_async(std::string(262144, 'x')))
+			{
+			}
+		});
+		ttf::utils::wait_miliseconds(2);
+		p.kill();
+		writer.join();
+	}
+}
+
+void test_stdin_feed_shell()
+{
+	std::string content;
+	for (int i = 0; content.size() < 3 * 1024 * 1024; i++)
+		content += std::to_string(i) + '\n';
+
+	const char* path = "/tmp/subprocess_test_feed.txt";
+	{
+		std::ofstream f(path, std::ios::binary);
+		f << content;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	TTF_ASSERT(fd != -1);
+
+	{
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("cat"));
+
+		std::string out;
+		subprocess	p;
+		TTF_ASSERT(p.start(cd, [&](const char* b, const std::size_t sz) { out.append(b, sz); }, nullptr));
+
+		// queued writes, fed ranges and gifted buffers keep their order
+		TTF_ASSERT(p.stdin_write("head\n"));
+		TTF_ASSERT(p.stdin_feed_fd(fd));
+		TTF_ASSERT(p.stdin_feed_fd(fd, 100, 50));
+		TTF_ASSERT(p.stdin_feed_fd(fd, std::int64_t(content.size()) - 10, 20) == false); // past the end
+		std::atomic<bool> gifted{ false };
+		TTF_ASSERT(p.stdin_feed_buffer(content, [&](const bool ok) { gifted = ok; }));
+		TTF_ASSERT(p.stdin_write_async("tail\n"));
+		TTF_ASSERT(p.stdin_flush());
+		TTF_ASSERT(gifted);
+
+		p.stdin_close();
+		TTF_ASSERT(p.join() == 0);
+		TTF_ASSERT(out == "head\n" + content + content.substr(100, 50) + content.substr(content.size() - 10) + content + "tail\n");
+	}
+
+	{
+		// without a background thread the caller moves the data itself
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("wc -c > /tmp/subprocess_test_feed.count"));
+		cd.stdout_redirect = subprocess::Redirect::to_null();
+		cd.stderr_redirect = subprocess::Redirect::to_null();
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, nullptr, nullptr));
+		TTF_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+		TTF_ASSERT(p.stdin_feed_fd(fd, -1));
+		TTF_ASSERT(lseek(fd, 0, SEEK_CUR) == off_t(content.size()));
+		p.stdin_close();
+		TTF_ASSERT(p.join() == 0);
+
+		std::ifstream f("/tmp/subprocess_test_feed.count");
+		std::size_t	  count = 0;
+		f >> count;
+		TTF_ASSERT(count == content.size());
+		unlink("/tmp/subprocess_test_feed.count");
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+void test_run_capture_shell()
+{
+	subprocess::CreateData cd;
+	TTF_ASSERT(cd.make_shell("head -c 1000000 /dev/zero; echo err >&2; exit 4"));
+
+	for (std::size_t hint : { std::size_t(0), std::size_t(1000), std::size_t(1000000) })
+	{
+		subprocess::CaptureOptions options;
+		options.stdout_hint = hint;
+
+		auto r = subprocess::run_capture(cd, options);
+		TTF_ASSERT(r.started);
+		TTF_ASSERT(r.rc == 4);
+		TTF_ASSERT(r.out == std::string(1000000, '\0'));
+		TTF_ASSERT(r.err == "err\n");
+		TTF_ASSERT(r.out_truncated == false);
+	}
+
+	{
+		// the child still runs to completion past the cap
+		subprocess::CaptureOptions options;
+		options.max_bytes = 10000;
+
+		auto r = subprocess::run_capture(cd, options);
+		TTF_ASSERT(r.rc == 4);
+		TTF_ASSERT(r.out == std::string(10000, '\0'));
+		TTF_ASSERT(r.out_truncated);
+		TTF_ASSERT(r.err == "err\n");
+		TTF_ASSERT(r.err_truncated == false);
+	}
+
+	{
+		subprocess::CaptureOptions options;
+		options.stdin_data = "one\ntwo\n";
+
+		TTF_ASSERT(cd.make_shell("wc -l"));
+		auto r = subprocess::run_capture(cd, options);
+		TTF_ASSERT(r.rc == 0);
+		TTF_ASSERT(r.out.find('2') != std::string::npos);
+
+		// no stdin data still closes stdin
+		TTF_ASSERT(cd.make_shell("cat"));
+		TTF_ASSERT(subprocess::run_capture(cd).out.empty());
+	}
+
+	{
+		cd.exe = "/nonexistent/executable";
+		auto r = subprocess::run_capture(cd);
+		TTF_ASSERT(r.started == false);
+		TTF_ASSERT(r.rc == -1);
+	}
+}
+
+void test_basic_subprocess_shell()
+{
+	{
+		// captured straight into strings, nothing locked
+		basic_subprocess<std::string, null_lock> p;
+
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("echo out; echo err >&2; exit 2"));
+		TTF_ASSERT(p.start(cd));
+		TTF_ASSERT(p.join() == 2);
+		TTF_ASSERT(p.stdout_sink() == "out\n");
+		TTF_ASSERT(p.stderr_sink() == "err\n");
+	}
+
+	{
+		struct counter
+		{
+			std::size_t bytes = 0;
+			std::size_t calls = 0;
+
+			void operator()(const char*, const std::size_t sz) noexcept
+			{
+				bytes += sz;
+				calls++;
+			}
+		};
+
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("head -c 1000000 /dev/zero"));
+		subprocess::PreparedCommand cmd(cd);
+
+		std::atomic<int>			rc{ -1 };
+		basic_subprocess<counter>	p;
+		TTF_ASSERT(p.start(cmd, [&](const int code) { rc = code; }));
+		TTF_ASSERT(p.join() == 0);
+		TTF_ASSERT(rc == 0);
+		TTF_ASSERT(p.stdout_sink().bytes == 1000000);
+		TTF_ASSERT(p.stdout_sink().calls > 0);
+		TTF_ASSERT(p.stderr_sink().bytes == 0);
+	}
+}
+
+void test_line_mode_shell()
+{
+	auto lines = [](subprocess::CreateData cd, const std::string& cmd) {
+		std::vector<std::string> result;
+		TTF_ASSERT(cd.make_shell(cmd));
+		cd.line_mode = true;
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, [&](const char* b, const std::size_t sz) { result.emplace_back(b, sz); }, nullptr));
+		TTF_ASSERT(p.join() == 0);
+		return result;
+	};
+
+	subprocess::CreateData cd;
+	TTF_ASSERT((lines(cd, "printf 'a\\nbb\\n\\nccc'") == std::vector<std::string>{ "a", "bb", "", "ccc" }));
+
+	// lines cut by every read size, and every way of draining the pipe
+	subprocess_reactor reactor;
+	for (int mode = 0; mode < 3; mode++)
+	{
+		subprocess::CreateData big;
+		big.buffer_size = 7;
+		big.use_io_uring = mode == 1;
+		big.reactor = mode == 2 ? &reactor : nullptr;
+
+		auto result = lines(big, "seq 1 20000");
+		TTF_ASSERT(result.size() == 20000);
+		for (std::size_t i = 0; i < result.size(); i++)
+			TTF_ASSERT(result[i] == std::to_string(i + 1));
+	}
+
+	cd.max_line_length = 4;
+	TTF_ASSERT((lines(cd, "echo abcdefghij; echo abcd") == std::vector<std::string>{ "abcd", "efgh", "ij", "abcd" }));
+	cd.buffer_size = 3;
+	TTF_ASSERT((lines(cd, "echo abcdefghij; echo abcd") == std::vector<std::string>{ "abcd", "efgh", "ij", "abcd" }));
+
+	cd.line_overflow = subprocess::line_overflow_t::truncate;
+	TTF_ASSERT((lines(cd, "echo abcdefghij; echo xy") == std::vector<std::string>{ "abcd", "xy" }));
+	cd.buffer_size = 131072;
+	TTF_ASSERT((lines(cd, "echo abcdefghij; echo xy") == std::vector<std::string>{ "abcd", "xy" }));
+
+	subprocess::CreateData nul;
+	nul.line_delimiter = '\0';
+	TTF_ASSERT((lines(nul, "printf 'x y\\0z\\0'") == std::vector<std::string>{ "x y", "z" }));
+}
+
+void test_buffering_shell()
+{
+	for (int mode = 0; mode < 2; mode++)
+	{
+		// reads start small and grow with a child that keeps the pipe full
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("head -c 8000000 /dev/zero"));
+		cd.use_io_uring = mode == 1;
+		cd.buffer_size = 65536;
+		cd.pipe_capacity = 262144;
+
+		std::size_t total = 0;
+		std::size_t largest = 0;
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, [&](const char*, const std::size_t sz) {
+			total += sz;
+			largest = std::max(largest, sz);
+		}, nullptr));
+		TTF_ASSERT(p.join() == 0);
+		TTF_ASSERT(total == 8000000);
+		TTF_ASSERT(largest > 4096);
+		TTF_ASSERT(largest <= cd.buffer_size);
+	}
+
+	{
+		// a larger pipe takes more input before a child that does not read holds it up
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("sleep 5"));
+		cd.pipe_capacity = 524288;
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, nullptr, nullptr));
+		TTF_ASSERT(p.stdin_write_async(std::string(262144, 'x')));
+		TTF_ASSERT(p.stdin_pending() == 0);
+		p.kill();
+	}
+}
+
+void test_merge_stderr_shell()
+{
+	subprocess::CreateData cd;
+	TTF_ASSERT(cd.make_shell("for i in 1 2 3; do echo out$i; echo err$i >&2; done"));
+	cd.merge_stderr = true;
+
+	result r;
+	run(r, cd);
+	TTF_ASSERT(r.rc == 0);
+	TTF_ASSERT(r.sout == "out1\nerr1\nout2\nerr2\nout3\nerr3\n");
+	TTF_ASSERT(r.serr.empty());
+
+	// follows stdout wherever it goes
+	const char* path = "/tmp/subprocess_test_merge.txt";
+	cd.stdout_redirect = subprocess::Redirect::to_file(path);
+	subprocess p;
+	TTF_ASSERT(p.start(cd, nullptr, nullptr));
+	TTF_ASSERT(p.join() == 0);
+
+	std::ifstream	  f(path);
+	std::stringstream ss;
+	ss << f.rdbuf();
+	TTF_ASSERT(ss.str() == "out1\nerr1\nout2\nerr2\nout3\nerr3\n");
+	unlink(path);
+}
+
+std::size_t thread_count()
+{
+	std::ifstream f("/proc/self/status");
+	std::string	  line;
+	while (std::getline(f, line))
+	{
+		if (line.compare(0, 8, "Threads:") == 0)
+			return std::size_t(std::stoul(line.substr(8)));
+	}
+	return 0;
+}
+
+void test_join_for_shell()
+{
+	for (int mode = 0; mode < 2; mode++)
+	{
+		// pidfd, and the exit state of a process with an exit function
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("sleep 0.3; exit 5"));
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, nullptr, nullptr, mode == 1 ? subprocess::exitfunc_t([](int) {}) : nullptr));
+
+		int	 rc = -1;
+		auto begin = std::chrono::steady_clock::now();
+		TTF_ASSERT(p.join_for(std::chrono::milliseconds(20), rc) == false);
+		TTF_ASSERT(std::chrono::steady_clock::now() - begin >= std::chrono::milliseconds(20));
+		TTF_ASSERT(p.joinable());
+		TTF_ASSERT(p.join_until(std::chrono::steady_clock::now() + std::chrono::seconds(5), rc));
+		TTF_ASSERT(rc == 5);
+		TTF_ASSERT(p.joinable() == false);
+		TTF_ASSERT(p.join_for(std::chrono::milliseconds(1), rc) == false);
+	}
+}
+
+void test_join_result_shell()
+{
+	for (int mode = 0; mode < 3; mode++)
+	{
+		// waited for directly, reaped by the exit watcher, and polled with try_join
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("i=0; while [ $i -lt 100000 ]; do i=$((i+1)); done; sleep 0.2; exit 4"));
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, nullptr, nullptr, mode == 1 ? subprocess::exitfunc_t([](int) {}) : nullptr));
+
+		subprocess::JoinResult r;
+		if (mode == 2)
+		{
+			while (p.try_join(r) == false)
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		else
+		{
+			TTF_ASSERT(p.join(r) == 4);
+		}
+
+		TTF_ASSERT(r.rc == 4);
+		TTF_ASSERT(r.has_usage);
+		TTF_ASSERT(r.wall_time >= std::chrono::milliseconds(200));
+		TTF_ASSERT(r.wall_time < std::chrono::seconds(10));
+		TTF_ASSERT(r.user_time + r.system_time > std::chrono::microseconds(0));
+		TTF_ASSERT(r.user_time + r.system_time < r.wall_time);
+		TTF_ASSERT(r.max_rss > 0);
+		TTF_ASSERT(r.voluntary_switches + r.involuntary_switches > 0);
+	}
+
+	{
+		// a slow exit function is not the child's time
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("exit 2"));
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, nullptr, nullptr, [](int) { std::this_thread::sleep_for(std::chrono::milliseconds(500)); }));
+
+		subprocess::JoinResult r;
+		TTF_ASSERT(p.join(r) == 2);
+		TTF_ASSERT(r.wall_time < std::chrono::milliseconds(400));
+	}
+}
+
+void test_high_fd_shell()
+{
+	// every descriptor of the process lands above FD_SETSIZE
+	rlimit lim;
+	TTF_ASSERT(getrlimit(RLIMIT_NOFILE, &lim) == 0);
+	const rlimit saved = lim;
+	if (lim.rlim_max != RLIM_INFINITY && lim.rlim_max < 2048)
+		return; // can't be tested here
+	lim.rlim_cur = std::max<rlim_t>(lim.rlim_cur, 2048);
+	TTF_ASSERT(setrlimit(RLIMIT_NOFILE, &lim) == 0);
+
+	std::vector<int> ballast;
+	int				 fd;
+	while ((fd = dup(0)) != -1 && fd < 1100)
+		ballast.push_back(fd);
+	if (fd != -1)
+		ballast.push_back(fd);
+
+	for (int mode = 0; mode < 2; mode++)
+	{
+		// the buffering thread alone, and with the exit watched as well
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("cat; echo err >&2; exit 6"));
+
+		result r;
+		int	   exit_rc = -1;
+		auto   exit_func = mode == 1 ? subprocess::exitfunc_t([&](int rc) { exit_rc = rc; }) : nullptr;
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, [&](const char* d, const std::size_t sz) { r.sout.append(d, sz); }, [&](const char* d, const std::size_t sz) { r.serr.append(d, sz); }, exit_func));
+		TTF_ASSERT(p.exit_fd() == -1 || p.exit_fd() >= 1100);
+		TTF_ASSERT(p.stdin_write("hello\n"));
+		p.stdin_close();
+		TTF_ASSERT(p.join() == 6);
+		TTF_ASSERT(r.sout == "hello\n");
+		TTF_ASSERT(r.serr == "err\n");
+		TTF_ASSERT(mode == 0 || exit_rc == 6);
+	}
+
+	for (int b : ballast)
+		close(b);
+	setrlimit(RLIMIT_NOFILE, &saved);
+}
+
+#ifdef SUBPROCESS_ENABLE_METRICS
+void test_metrics_shell()
+{
+	subprocess_metrics::reset();
+
+	subprocess::CreateData cd;
+	TTF_ASSERT(cd.make_shell("cat; echo oops >&2"));
+
+	std::size_t received = 0;
+	subprocess	p;
+	TTF_ASSERT(p.start(cd, [&](const char*, const std::size_t sz) { received += sz; }, [](const char*, const std::size_t) {}));
+	TTF_ASSERT(p.stdin_write(std::string(1 << 20, 'x')));
+	p.stdin_close();
+	TTF_ASSERT(p.join() == 0);
+
+	auto m = subprocess_metrics::snapshot();
+	TTF_ASSERT(m.spawns == 1);
+	TTF_ASSERT(m.spawn_failures == 0);
+	TTF_ASSERT(m.pipe_setup.count == 1);
+	TTF_ASSERT(m.spawn.count == 1);
+	TTF_ASSERT(m.spawn.total_ns > 0);
+	TTF_ASSERT(m.first_byte.count == 2);
+	TTF_ASSERT(m.join_wait.count == 1);
+	TTF_ASSERT(m.stdout_bytes == received);
+	TTF_ASSERT(m.stdout_bytes == 1 << 20);
+	TTF_ASSERT(m.stderr_bytes == 5);
+	TTF_ASSERT(m.stdin_bytes == 1 << 20);
+	TTF_ASSERT(m.callback.count == m.stdout_callbacks + m.stderr_callbacks);
+	TTF_ASSERT(m.stdin_stall.count == 1); // a megabyte does not fit in the pipe
+
+	std::uint64_t bucketed = 0;
+	for (auto b : m.callback.bucket)
+		bucketed += b;
+	TTF_ASSERT(bucketed == m.callback.count);
+
+	subprocess::CreateData missing;
+	missing.exe = "/nonexistent/binary";
+	missing.argv = { "binary" };
+	TTF_ASSERT(p.start(missing, nullptr, nullptr) == false);
+	TTF_ASSERT(subprocess_metrics::snapshot().spawn_failures == 1);
+
+	subprocess_metrics::reset();
+	TTF_ASSERT(subprocess_metrics::snapshot().spawns == 0);
+}
+#endif
+
+void test_timeout_shell()
+{
+	{
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("echo started; sleep 10"));
+		cd.timeout = std::chrono::milliseconds(100);
+
+		result r;
+		auto   begin = std::chrono::steady_clock::now();
+		run(r, cd);
+		TTF_ASSERT(std::chrono::steady_clock::now() - begin < std::chrono::seconds(5));
+		TTF_ASSERT(r.sout == "started\n");
+	}
+
+	{
+		// SIGTERM is ignored, SIGKILL follows after kill_timeout
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("trap '' TERM; sleep 10"));
+		cd.timeout = std::chrono::milliseconds(50);
+		cd.kill_timeout = std::chrono::milliseconds(100);
+
+		subprocess p;
+		TTF_ASSERT(p.start(cd, nullptr, nullptr));
+		int rc = 0;
+		TTF_ASSERT(p.join_for(std::chrono::seconds(5), rc));
+	}
+
+	{
+		// deadlines share one timer thread
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("sleep 10"));
+		cd.timeout = std::chrono::milliseconds(100);
+		cd.stdout_redirect = subprocess::Redirect::to_null();
+		cd.stderr_redirect = subprocess::Redirect::to_null();
+
+		std::vector<subprocess> processes(50);
+		auto					threads = thread_count();
+		for (auto& p : processes)
+			TTF_ASSERT(p.start(cd, nullptr, nullptr));
+		TTF_ASSERT(thread_count() <= threads + 1);
+
+		auto begin = std::chrono::steady_clock::now();
+		for (auto& p : processes)
+			p.join();
+		TTF_ASSERT(std::chrono::steady_clock::now() - begin < std::chrono::seconds(5));
+	}
+
+	{
+		// a process that is done in time is left alone
+		subprocess::CreateData cd;
+		TTF_ASSERT(cd.make_shell("exit 3"));
+		cd.timeout = std::chrono::milliseconds(10000);
+
+		result r;
+		run(r, cd);
+		TTF_ASSERT(r.rc == 3);
+	}
+}
+
 void test_main()
 {
 
@@ -273,6 +1569,35 @@ void test_main()
 	TEST_FUNCTION(test_stderr_shell);
 	TEST_FUNCTION(test_reuse_shell);
 	TEST_FUNCTION(test_kill_shell);
+	TEST_FUNCTION(test_reactor_shell);
+	TEST_FUNCTION(test_reactor_cross_process_shell);
+	TEST_FUNCTION(test_io_uring_shell);
+	TEST_FUNCTION(test_try_join_shell);
+	TEST_FUNCTION(test_kill_timeout_shell);
+	TEST_FUNCTION(test_on_exit_shell);
+	TEST_FUNCTION(test_pool_shell);
+	TEST_FUNCTION(test_fork_server_shell);
+	TEST_FUNCTION(test_spawn_strategy_shell);
+	TEST_FUNCTION(test_prepared_command_shell);
+	TEST_FUNCTION(test_search_path_shell);
+	TEST_FUNCTION(test_environment_shell);
+	TEST_FUNCTION(test_redirect_shell);
+	TEST_FUNCTION(test_pipeline_shell);
+	TEST_FUNCTION(test_tee_shell);
+	TEST_FUNCTION(test_stdin_async_shell);
+	TEST_FUNCTION(test_stdin_feed_shell);
+	TEST_FUNCTION(test_run_capture_shell);
+	TEST_FUNCTION(test_basic_subprocess_shell);
+	TEST_FUNCTION(test_line_mode_shell);
+	TEST_FUNCTION(test_buffering_shell);
+	TEST_FUNCTION(test_merge_stderr_shell);
+	TEST_FUNCTION(test_join_for_shell);
+	TEST_FUNCTION(test_timeout_shell);
+	TEST_FUNCTION(test_join_result_shell);
+	TEST_FUNCTION(test_high_fd_shell);
+#	ifdef SUBPROCESS_ENABLE_METRICS
+	TEST_FUNCTION(test_metrics_shell);
+#	endif
 #endif
 }
 